@@ -4,6 +4,13 @@
 #include <vector>
 #include <array>
 #include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
 
 #include <Eigen/Sparse>
 #include <Eigen/Dense>
@@ -23,506 +30,1334 @@ using Vec = Eigen::Matrix<real, d, 1>;
 //using Mat = Eigen::Matrix<real, d, d>;
 template <int m, int n = m>
 using Mat = Eigen::Matrix<real, m, n>;
+using VecX = Vec<Eigen::Dynamic>;
+template <typename T>
+using Array = std::vector<T, Eigen::aligned_allocator<T>>;
 #define PI 3.141592653589793238463
 
 // Constants
-const int Nx = 20, N = Nx * Nx; // free particles
-const int Nw = 30, Nb = 4 * Nw; // boundary particles
-const int grid_res = 10, window_size = 800;
-const int bucket_size = 64;
+const int window_size = 800;
 const int N_screen = 360;
-const real dx = 1.0 / grid_res, dx_inv = (real)grid_res;
 const real R = 0.5; //init rect side length
 const Vec2i nb_dirs[9] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1}};
 const int colors[3] = {0xED553B, 0xF2B134, 0x068587};
 
-//parameters
-real l0 = sqrt(R * R / N);
-real dt = 1e-2;
-Vec2 grav{0, -1.0};
-real re = 3.1 * l0;
-real rs = re / 2;
-real alpha = 1e-2; // particle shifting
-real beta = 0.95;  // boundary detection
-real eps = 1e-3;
-real n0; //reference particle density
-real rho = 1.0;
-Eigen::DiagonalMatrix<real, 5> Hrs;
-Eigen::DiagonalMatrix<real, 6> Hhat;
-Eigen::DiagonalMatrix<real, 5> H1_inv;
-Vec2 bound_min = Vec2(0.05, 0.05), bound_max = Vec2(0.95, 0.95);
-
-// Data
-int current_frame;
-std::array<Vec2, N> X, V, V_a, V_star;
-std::array<char, N> Label; // 0=free, 1=near wall boundary, 2=free boundary
-std::array<Mat<5>, N> M, M_n;
-std::array<Mat<6>, N> M_hat;
-using Bucket = std::array<int, bucket_size>;
-std::array<Bucket, grid_res * grid_res> hashing;
-std::array<Vec2, Nb> X_b, N_b;
-std::vector<Triplet> triplets;
-SpMat Laplacian;
-Vec<N> rhs, Pdt;
-
-inline real W(real r)
+struct Pair // A neighbor j of particle i, see LSMPS::pairs
 {
-    real ret = 0.0;
-    if (r < re)
-        ret = pow(1 - r / re, 2);
-    return ret;
-}
+    int j;
+    real r, w, wa;
+    Vec2 rij;
+};
 
-inline real Wa(real r)
+struct SolveStats
 {
-    real ret = 0.0;
-    if (r < re)
-        ret = re / r - 1;
-    return ret;
+    int iterations;
+    real error; // Relative residual reached
 };
 
-inline real Wup(real r, real costheta)
+// Metrics of one LSMPS::advance(): plain data, so recording a step is a copy;
+// write() formats it on the telemetry drain thread.
+struct StepRecord
 {
-    return W(r) * std::max(2 * costheta * costheta - 1, eps);
-}
+    int frame;
+    SolveStats pressure;
+    real phase_time[8]; // s: shifting, advection, position, neighbors, label, moments, pressure, projection
+    long long pairs;    // Neighbor list entries, self pairs included
+    int labels[3];      // Particles per Label value
 
-inline Vec<5> P(const Vec2 &r)
+    static const char *header()
+    {
+        return "frame,iterations,error,t_shifting,t_advection,t_position,t_neighbors,t_label,t_moments,t_pressure,t_projection,"
+               "pairs,label0,label1,label2";
+    }
+    void write(FILE *f) const
+    {
+        std::fprintf(f, "%d,%d,%.3e", frame, pressure.iterations, pressure.error);
+        for (real t : phase_time)
+            std::fprintf(f, ",%.3e", t);
+        std::fprintf(f, ",%lld", pairs);
+        for (int n : labels)
+            std::fprintf(f, ",%d", n);
+        std::fprintf(f, "\n");
+    }
+};
+
+// Free surface screen: N_screen one-degree bins around a particle, packed into
+// 64-bit words. Each neighbor hides the bins its disc covers as seen from i.
+struct AngularScreen
 {
-    Vec<5> ret;
-    ret << r(0), r(1), r(0) * r(0), r(0) * r(1), r(1) * r(1);
-    return ret;
-}
+    uint64_t bits[(N_screen + 63) / 64] = {};
+
+    void set(int begin, int count) // Bins begin .. begin + count - 1, cyclic
+    {
+        int end = begin + count;
+        if (end > N_screen)
+        {
+            set(0, end - N_screen);
+            end = N_screen;
+        }
+        for (int w = begin / 64; w * 64 < end; ++w)
+        {
+            int lo = std::max(begin - w * 64, 0), hi = std::min(end - w * 64, 64);
+            uint64_t upto_hi = hi == 64 ? ~uint64_t(0) : (uint64_t(1) << hi) - 1;
+            bits[w] |= upto_hi & ~((uint64_t(1) << lo) - 1);
+        }
+    }
+
+    int count() const
+    {
+        int n = 0;
+        for (uint64_t w : bits)
+            n += static_cast<int>(std::bitset<64>(w).count());
+        return n;
+    }
+};
 
-inline Vec<6> Phat(const Vec<2> &r)
+inline real atan2_approx(real y, real x) // |error| < 2e-8 (Abramowitz & Stegun 4.4.49)
 {
-    Vec<6> ret;
-    ret << 1, r(0), r(1), r(0) * r(0), r(0) * r(1), r(1) * r(1);
-    return ret;
+    real ax = std::abs(x), ay = std::abs(y);
+    real t = std::min(ax, ay) / std::max(ax, ay), t2 = t * t;
+    real a = t * (1 + t2 * (-0.3333314528 + t2 * (0.1999355085 + t2 * (-0.1420889944 + t2 * (0.1065626393 +
+             t2 * (-0.0752896400 + t2 * (0.0429096138 + t2 * (-0.0161657367 + t2 * 0.0028662257))))))));
+    if (ay > ax)
+        a = PI / 2 - a;
+    if (x < 0)
+        a = PI - a;
+    return y < 0 ? -a : a;
 }
 
-inline Vec<5> Q(const Vec2 &r, const Vec2 &n)
+// Matrix-free Laplacian for Eigen's Krylov solvers, which only need products
+// with it: Solver::apply_laplacian() computes them from the cached pairs.
+template <typename Solver>
+struct LaplacianOperator;
+
+namespace Eigen
 {
-    Vec<5> ret;
-    ret << n[0], n[1], 2 * n[0] * r[0], (n[0] * r[1] + n[1] * r[0]), 2 * n[1] * r[0];
-    return ret;
-}
+namespace internal
+{
+template <typename Solver>
+struct traits<LaplacianOperator<Solver>> : public traits<SparseMatrix<::real>> // real alone is Eigen::real()
+{
+};
+} // namespace internal
+} // namespace Eigen
 
-inline bool valid_cell(const Vec2i &c)
+template <typename Solver>
+struct LaplacianOperator : public Eigen::EigenBase<LaplacianOperator<Solver>>
 {
-    return (c[0] >= 0) && (c[0] < grid_res) && (c[1] >= 0) && (c[1] < grid_res);
-}
+    using Scalar = real;
+    using RealScalar = real;
+    using StorageIndex = int;
+    enum
+    {
+        ColsAtCompileTime = Eigen::Dynamic,
+        MaxColsAtCompileTime = Eigen::Dynamic,
+        IsRowMajor = false
+    };
+
+    const Solver *solver;
+
+    Eigen::Index rows() const { return solver->N; }
+    Eigen::Index cols() const { return solver->N; }
 
-inline bool near_boundary(const Vec2 &r)
+    template <typename Rhs>
+    Eigen::Product<LaplacianOperator, Rhs, Eigen::AliasFreeProduct> operator*(const Eigen::MatrixBase<Rhs> &x) const
+    {
+        return Eigen::Product<LaplacianOperator, Rhs, Eigen::AliasFreeProduct>(*this, x.derived());
+    }
+};
+
+namespace Eigen
 {
-    return (r[0] < bound_min[0] + re) || (r[0] > bound_max[0] - re) ||
-           (r[1] < bound_min[1] + re) || (r[1] > bound_max[1] - re);
-}
+namespace internal
+{
+template <typename Solver, typename Rhs>
+struct generic_product_impl<LaplacianOperator<Solver>, Rhs, SparseShape, DenseShape, GemvProduct>
+    : generic_product_impl_base<LaplacianOperator<Solver>, Rhs, generic_product_impl<LaplacianOperator<Solver>, Rhs>>
+{
+    template <typename Dest>
+    static void scaleAndAddTo(Dest &dst, const LaplacianOperator<Solver> &lhs, const Rhs &rhs, const ::real &alpha)
+    {
+        lhs.solver->apply_laplacian(rhs, dst, alpha);
+    }
+};
+} // namespace internal
+} // namespace Eigen
 
-inline bool far_from_surface(const Vec2 &r)
+// Jacobi preconditioner of a LaplacianOperator, from the solver's diagonal;
+// zeros are replaced by ones as in Eigen::DiagonalPreconditioner.
+struct OperatorJacobi
 {
-    real dist = 1e10;
-    for (int i = 0; i < N; ++i)
+    VecX inv_diag;
+
+    template <typename Op>
+    OperatorJacobi &analyzePattern(const Op &) { return *this; }
+    template <typename Op>
+    OperatorJacobi &factorize(const Op &op)
     {
-        if (Label[i] == 1)
-        {
-            dist = std::min(dist, (X[i] - r).norm());
-        }
+        inv_diag = op.solver->laplacian_diag.unaryExpr([](real d) { return d != 0 ? 1 / d : 1; });
+        return *this;
     }
-    if (dist >= re)
-        return true;
-    else
-        return false;
-}
+    template <typename Op>
+    OperatorJacobi &compute(const Op &op) { return factorize(op); }
+    VecX solve(const VecX &b) const { return inv_diag.cwiseProduct(b); }
+    Eigen::ComputationInfo info() const { return Eigen::Success; }
+};
 
-void reset_hashing()
+// Smoothed aggregation algebraic multigrid as a Krylov preconditioner: one
+// V-cycle with damped Jacobi smoothing per application. Strongly coupled
+// unknowns are grouped into aggregates, the piecewise constant prolongator
+// over them is smoothed by one Jacobi step, and coarse matrices are Galerkin
+// products. The hierarchy is reused for `reuse` factorizations, with only the
+// finest matrix replaced, since the particle couplings change slowly.
+class AMGPreconditioner
 {
-    std::fill(hashing.begin(), hashing.end(), Bucket{});
-    for (int i = 0; i < N; ++i)
+  public:
+    using Csr = Eigen::SparseMatrix<real, Eigen::RowMajor>;
+    int reuse = 4;        // factorize() calls served by one hierarchy
+    real strength = 0.25; // Strong coupling: |a_ij| >= strength * max_k!=i |a_ik|
+    int coarsest = 64;    // Size solved directly
+    int sweeps = 1;       // Jacobi sweeps before and after each coarse correction
+
+    template <typename M>
+    AMGPreconditioner &analyzePattern(const M &)
     {
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
-        if (!valid_cell(coord))
-        {
-            std::cerr << "[Error]out of box" << std::endl;
-            exit(1);
-        }
-        Bucket &bucket = hashing[coord[0] * grid_res + coord[1]];
-        if (bucket[0] >= bucket_size - 1)
+        return *this;
+    }
+
+    template <typename M>
+    AMGPreconditioner &factorize(const M &a)
+    {
+        if (age < reuse && !levels.empty() && levels[0].A.rows() == a.rows())
         {
-            std::cerr << "[Error]bucket full" << std::endl;
-            exit(1);
+            set_level(levels[0], Csr(a));
+            ++age;
         }
-        ++bucket[0];
-        bucket[bucket[0]] = i;
+        else
+            setup(a);
+        return *this;
     }
-}
 
-void update_label()
-{
-    std::fill(Label.begin(), Label.end(), 0);
-    for (int i = 0; i < N; ++i)
+    template <typename M>
+    AMGPreconditioner &compute(const M &a)
     {
-        if (near_boundary(X[i]))
-            Label[i] = 1;
-        else
+        return factorize(a);
+    }
+
+    void invalidate() { age = reuse; } // Unknowns renumbered: set up anew
+
+    VecX solve(const VecX &b) const { return cycle(0, b); }
+
+    Eigen::ComputationInfo info() const { return Eigen::Success; }
+
+    int num_levels() const { return static_cast<int>(levels.size()) + 1; }
+
+  private:
+    struct Level
+    {
+        Csr A, P, R;
+        VecX inv_diag; // 0 for a zero diagonal
+        real omega;    // Jacobi damping, 4 / 3 over a bound of rho(D^-1 A)
+    };
+    std::vector<Level> levels;
+    Eigen::PartialPivLU<Mat<Eigen::Dynamic>> coarse;
+    int age = 0;
+
+    static void set_level(Level &l, const Csr &a)
+    {
+        l.A = a;
+        l.inv_diag.resize(a.rows());
+        real rho = 0.0;
+        for (int i = 0; i < a.rows(); ++i)
         {
-            bool screen[N_screen];
-            std::fill(screen, screen + N_screen, false);
-            Vec2i coord = (X[i] * dx_inv).cast<int>();
-            for (int d = 0; d < 9; ++d)
-            {
-                Vec2i nb = coord + nb_dirs[d];
-                if (!valid_cell(nb))
-                    continue;
-                Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-                for (int p = 1; p <= bucket[0]; ++p)
-                {
-                    int j = bucket[p];
-                    if (i == j)
-                        continue;
-                    Vec2 dX = X[j] - X[i];
-                    if (dX.norm() > re)
-                        continue;
-                    real theta_ij = 180.0 / PI * (std::atan2(dX[1], dX[0]) + PI);
-                    real dtheta_ij = 180.0 / PI * std::atan2(0.5 * l0, sqrt(dX.dot(dX) - 0.25 * l0 * l0));
-                    int lowb = static_cast<int>(theta_ij - dtheta_ij) % N_screen;
-                    int rangeb = static_cast<int>(2 * dtheta_ij);
-                    for (int k = 0; k < rangeb; ++k)
-                    {
-                        int idx = (lowb + k) % N_screen;
-                        if (idx < 0)
-                            idx += N_screen;
-                        screen[idx] = true;
-                    }
-                }
-            }
-            int n_block = 0;
-            for (int k = 0; k < N_screen; ++k)
+            real d = 0.0, row_sum = 0.0;
+            for (Csr::InnerIterator it(a, i); it; ++it)
             {
-                n_block += static_cast<int>(screen[k]);
+                if (it.col() == i)
+                    d = it.value();
+                row_sum += std::abs(it.value());
             }
-            if (static_cast<double>(n_block) / N_screen < 5.0 / 6.0)
-                Label[i] = 2;
+            l.inv_diag[i] = d != 0 ? 1 / d : 0;
+            rho = std::max(rho, row_sum * std::abs(l.inv_diag[i]));
         }
+        l.omega = 4.0 / 3.0 / std::max(rho, real(1));
     }
-}
 
-void compute_M()
-{
-    for (int i = 0; i < N; ++i)
+    // Greedy aggregation (Vanek et al.): a free unknown whose strong neighbors
+    // are all free takes them as its aggregate, leftovers join the aggregate
+    // they couple to most strongly or group among themselves. Unknowns without
+    // strong couplings stay out (-1) and are left to the smoother.
+    int aggregate(const Csr &a, std::vector<int> &agg) const
     {
-        M[i] = Mat<5>::Zero();
-        M_hat[i] = Mat<6>::Zero();
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
-        for (int d = 0; d < 9; ++d)
+        const int n = a.rows(), free = -2;
+        VecX max_off = VecX::Zero(n);
+        for (int i = 0; i < n; ++i)
+            for (Csr::InnerIterator it(a, i); it; ++it)
+                if (it.col() != i)
+                    max_off[i] = std::max(max_off[i], std::abs(it.value()));
+        auto strong = [&](int i, const Csr::InnerIterator &it) {
+            return it.col() != i && it.value() != 0 && std::abs(it.value()) >= strength * max_off[i];
+        };
+        agg.assign(n, -1);
+        for (int i = 0; i < n; ++i)
+            for (Csr::InnerIterator it(a, i); it; ++it)
+                if (strong(i, it))
+                    agg[i] = free;
+        int n_agg = 0;
+        for (int i = 0; i < n; ++i)
         {
-            Vec2i nb = coord + nb_dirs[d];
-            if (!valid_cell(nb))
+            if (agg[i] != free)
                 continue;
-            Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-            for (int p = 1; p <= bucket[0]; ++p)
-            {
-                int j = bucket[p];
-                if (i == j)
+            bool all_free = true;
+            for (Csr::InnerIterator it(a, i); it; ++it)
+                if (strong(i, it) && agg[it.col()] >= 0)
+                    all_free = false;
+            if (!all_free)
+                continue;
+            for (Csr::InnerIterator it(a, i); it; ++it)
+                if (strong(i, it))
+                    agg[it.col()] = n_agg;
+            agg[i] = n_agg++;
+        }
+        std::vector<int> roots = agg;
+        for (int i = 0; i < n; ++i)
+        {
+            if (agg[i] != free)
+                continue;
+            real best = 0.0;
+            for (Csr::InnerIterator it(a, i); it; ++it)
+                if (strong(i, it) && roots[it.col()] >= 0 && std::abs(it.value()) > best)
                 {
-                    Vec<6> phat = Phat(Vec2::Zero());
-                    if (near_boundary(X[i]) || far_from_surface(X[i]))
-                        M_hat[i] += W(0) * phat * phat.transpose();
-                    continue;
+                    best = std::abs(it.value());
+                    agg[i] = roots[it.col()];
                 }
-                Vec<5> pij = P((X[j] - X[i]) / rs);
-                Vec<6> phat = Phat((X[j] - X[i]) / rs);
-                M[i] += W((X[j] - X[i]).norm()) * pij * pij.transpose();
-                M_hat[i] += W((X[j] - X[i]).norm()) * phat * phat.transpose();
-            }
         }
+        for (int i = 0; i < n; ++i)
+        {
+            if (agg[i] != free)
+                continue;
+            for (Csr::InnerIterator it(a, i); it; ++it)
+                if (strong(i, it) && agg[it.col()] == free)
+                    agg[it.col()] = n_agg;
+            agg[i] = n_agg++;
+        }
+        return n_agg;
     }
-    for (int i = 0; i < N; ++i)
+
+    template <typename M>
+    void setup(const M &matrix)
     {
-        if (!near_boundary(X[i]))
-            continue;
-        M_n[i] = Mat<5>::Zero();
-        for (int j = 0; j < Nb; ++j)
+        levels.clear();
+        age = 0;
+        Csr a = matrix;
+        std::vector<int> agg;
+        while (a.rows() > coarsest)
         {
-            Vec2 rij = X_b[j] - X[i];
-            if (rij.norm() > re)
-                continue;
-            Vec<5> qij = Q(rij / rs, N_b[j]);
-            M_n[i] += W(rij.norm()) * qij * qij.transpose();
+            Level l;
+            set_level(l, a);
+            int n_agg = aggregate(a, agg);
+            std::vector<Eigen::Triplet<real>> t;
+            for (int i = 0; i < a.rows(); ++i)
+                if (agg[i] >= 0)
+                    t.emplace_back(i, agg[i], 1.0);
+            Csr T(a.rows(), n_agg);
+            T.setFromTriplets(t.begin(), t.end());
+            Csr smoothing = (l.omega * l.inv_diag).asDiagonal() * a;
+            Csr smoothed = smoothing * T;
+            l.P = T - smoothed;
+            l.R = l.P.transpose();
+            a = Csr(l.R * (a * l.P)).pruned();
+            levels.push_back(std::move(l));
+            if (n_agg == 0 || n_agg == levels.back().A.rows()) // No coarsening left
+                break;
         }
+        if (a.rows() > 0)
+            coarse.compute(a.toDense());
     }
-}
 
-void init()
+    VecX cycle(size_t k, const VecX &b) const
+    {
+        if (k == levels.size())
+            return b.size() > 0 ? VecX(coarse.solve(b)) : b;
+        const Level &l = levels[k];
+        VecX x = l.omega * l.inv_diag.cwiseProduct(b);
+        for (int s = 1; s < sweeps; ++s)
+            x += l.omega * l.inv_diag.cwiseProduct(b - l.A * x);
+        x += l.P * cycle(k + 1, l.R * (b - l.A * x));
+        for (int s = 0; s < sweeps; ++s)
+            x += l.omega * l.inv_diag.cwiseProduct(b - l.A * x);
+        return x;
+    }
+};
+
+// Per-step telemetry: the simulation thread push()es plain records into a
+// lock-free single-producer single-consumer ring, and never formats or
+// flushes. A drain thread writes them out as CSV through Record::write().
+// When the ring is full the record is dropped and counted instead of
+// stalling the step.
+template <typename Record>
+class Telemetry
 {
-    Hrs.diagonal() << 1 / rs, 1 / rs, 2 / (rs * rs), 1 / (rs * rs), 2 / (rs * rs);
-    Hhat.diagonal() << 1, 1 / rs, 1 / rs, 2 / (rs * rs), 1 / (rs * rs), 2 / (rs * rs);
-    H1_inv.diagonal() << 1, 1, 0.5, 1, 0.5;
-    //free particles
-    std::fill(V.begin(), V.end(), Vec2::Zero());
-    real tdx = R / Nx;
-    n0 = 0.0;
-    Vec2 ref_X = Vec2(0.5 - R / 2 + tdx * (Nx / 2), 0.5 - R / 2 + tdx * (Nx / 2));
-    for (int i = 0; i < Nx; ++i)
-    {
-        for (int j = 0; j < Nx; ++j)
+  public:
+    explicit Telemetry(const std::string &path, size_t capacity = 1024) // "-": stdout
+        : ring(capacity + 1)
+    {
+        file = path == "-" ? stdout : std::fopen(path.c_str(), "w");
+        if (!file)
         {
-            X[i * Nx + j] = Vec2(0.5 - R / 2 + tdx * i, 0.5 - R / 2 + tdx * j);
-            if ((i != Nx / 2) || (j != Nx / 2))
-                n0 += Wa((X[i * Nx + j] - ref_X).norm());
+            std::cerr << "cannot write " << path << std::endl;
+            return;
         }
+        drain = std::thread([this] { run(); });
     }
 
-    //wall boundary
-    real tdw = (bound_max[0] - bound_min[0]) / Nw;
-    Vec2 norms[4] = {Vec2(0.0, 1.0), Vec2(-1.0, 0.0), Vec2(0.0, -1.0), Vec2(1.0, 0.0)};
-    Vec2 dirs[4] = {Vec2(1.0, 0.0), Vec2(0.0, 1.0), Vec2(-1.0, 0.0), Vec2(0.0, -1.0)};
-    Vec2 offsets[4] = {Vec2(bound_min[0] + tdw / 2, bound_min[1]), Vec2(bound_max[0], bound_min[1] + tdw / 2),
-                       Vec2(bound_max[0] - tdw / 2, bound_max[1]), Vec2(bound_min[0], bound_max[1] - tdw / 2)};
-    for (int i = 0; i < Nw; ++i)
+    ~Telemetry() // Writes out what is left
     {
-        for (int j = 0; j < 4; ++j)
+        done.store(true, std::memory_order_release);
+        if (drain.joinable())
+            drain.join();
+        if (file && file != stdout)
+            std::fclose(file);
+    }
+
+    void push(const Record &r)
+    {
+        size_t t = tail.load(std::memory_order_relaxed), next = (t + 1) % ring.size();
+        if (!file || next == head.load(std::memory_order_acquire))
         {
-            N_b[j * Nw + i] = norms[j];
-            X_b[j * Nw + i] = offsets[j] + i * tdw * dirs[j];
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
         }
+        ring[t] = r;
+        tail.store(next, std::memory_order_release);
     }
-    reset_hashing();
-    compute_M();
-    update_label();
-}
 
-void particle_shifting()
-{
-    for (int i = 0; i < N; ++i)
+  private:
+    std::vector<Record> ring; // One slot stays empty to tell full from empty
+    std::atomic<size_t> head{0}, tail{0};
+    std::atomic<long long> dropped{0};
+    std::atomic<bool> done{false};
+    FILE *file;
+    std::thread drain;
+
+    void run()
     {
-        Vec2 delta = Vec2::Zero();
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
-        for (int d = 0; d < 9; ++d)
+        std::fprintf(file, "%s\n", Record::header());
+        for (;;)
         {
-            Vec2i nb = coord + nb_dirs[d];
-            if (!valid_cell(nb))
-                continue;
-            Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-            for (int p = 1; p <= bucket[0]; ++p)
+            bool finished = done.load(std::memory_order_acquire); // Before draining: no record is missed
+            size_t h = head.load(std::memory_order_relaxed);
+            for (; h != tail.load(std::memory_order_acquire); h = (h + 1) % ring.size())
             {
-                int j = bucket[p];
-                real rij = (X[j] - X[i]).norm();
-                if (j != i)
-                    delta -= alpha * l0 * l0 * 2 / n0 * Wa(rij) * (X[j] - X[i]) / (rij * rij);
+                ring[h].write(file);
+                head.store((h + 1) % ring.size(), std::memory_order_release);
             }
+            std::fflush(file);
+            if (finished)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
         }
-        V_a[i] = V[i] + delta / dt;
+        if (dropped > 0)
+            std::fprintf(file, "# %lld records dropped\n", dropped.load());
+        std::fflush(file);
     }
-}
+};
 
-void advection_and_force()
+// The whole solver, sized at construction: Nx * Nx free particles, with the
+// wall and the cell grid scaled along (Nx = 20: 120 wall particles, 10 x 10
+// cells). Per-particle state is one runtime-sized aligned array per quantity.
+struct LSMPS
 {
-    for (int i = 0; i < N; ++i)
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    // Resolution
+    const int Nx, N;  // free particles
+    const int Nw, Nb; // boundary particles
+    const int grid_res, n_cells;
+    const real dx, dx_inv;
+
+    //parameters
+    real l0 = sqrt(R * R / N);
+    real dt = 1e-2;
+    Vec2 grav{0, -1.0};
+    real re = 3.1 * l0;
+    real rs = re / 2;
+    real alpha = 1e-2; // particle shifting
+    real beta = 0.95;  // boundary detection
+    real eps = 1e-3;
+    real n0; //reference particle density
+    real rho = 1.0;
+    Eigen::DiagonalMatrix<real, 5> Hrs;
+    Eigen::DiagonalMatrix<real, 6> Hhat;
+    Eigen::DiagonalMatrix<real, 5> H1_inv;
+    Vec2 bound_min = Vec2(0.05, 0.05), bound_max = Vec2(0.95, 0.95);
+
+    // Data
+    int current_frame = 0;
+    Array<Vec2> X, V, V_a, V_star;
+    std::vector<char> Label; // 0=free, 1=near wall boundary, 2=free boundary
+    Array<Mat<5>> M, M_n;
+    Array<Mat<6>> M_hat;
+    // Inverted once per compute_M() for all later passes; MN_inv = (M + M_n)^-1
+    // only for particles near the boundary
+    Array<Mat<5>> M_inv, MN_inv;
+    Array<Mat<6>> M_hat_inv;
+    // Cell list in CSR form, rebuilt by a counting sort: the particles of cell c
+    // are cell_particles[cell_begin[c] .. cell_begin[c + 1]), in index order.
+    std::vector<int> cell_begin, cell_particles;
+    // Scratch of build_cell_list(), kept per solver so that several can step at once
+    std::vector<int> chunk_count, particle_cell; // [cell][chunk], [particle]
+    Array<Vec2> old_vec2;                        // Copies permute() reads from
+    std::vector<char> old_char;
+    std::vector<int> old_int;
+    VecX old_real;
+    bool sort_particles = false; // Also reorder the particle arrays into cell order
+    std::vector<int> id;         // Seeding index of each particle
+    // Verlet neighbor list in CSR form: the particles within re + skin of particle
+    // i, i itself included, are pairs[pair_begin[i] .. pair_begin[i + 1]), in cell
+    // list order. Each pair caches rij = X[j] - X[i], its norm, W and Wa. The list
+    // is kept until some particle has moved more than skin / 2 since it was built;
+    // until then only the cached geometry is refreshed. re + skin must stay <= dx.
+    std::vector<int> pair_begin;
+    Array<Pair> pairs;
+    real skin = 0.0;     // 0: rebuild every step. Set through set_skin()
+    Array<Vec2> X_built; // X at the last build
+    Array<Vec2> X_b, N_b;
+    // Wall w holds X_b[w * Nw + k] = wall_origin[w] + k * wall_spacing * wall_dir[w],
+    // so the wall particles near a point form one index interval per wall
+    Vec2 wall_origin[4], wall_dir[4], wall_normal[4];
+    real wall_spacing;
+    std::vector<Triplet> triplets;
+    SpMat Laplacian;
+    VecX rhs, Pdt;
+    // AMG: GMRES is preconditioned by a hierarchy kept over several steps
+    // instead of the diagonal of the assembled Laplacian.
+    bool amg = false;
+    Eigen::GMRES<SpMat, AMGPreconditioner> gmres_amg;
+    SolveStats pressure_stats = {}; // Of the last solve
+    // Matrix-free: the solver applies the Laplacian from the pairs. Row i's
+    // coefficient for pair (i, j) is w * lap_g[i] . P(rij / rs), lap_g[i] being
+    // the rows of Hrs * M^-1 that make up the Laplacian; the diagonal is kept.
+    // There is no hierarchy without the matrix, so amg falls back to Jacobi.
+    bool matrix_free = false;
+    Array<Vec<5>> lap_g;
+    VecX laplacian_diag;
+    // Telemetry: advance() fills step, and also pushes it to telemetry if set
+    StepRecord step = {};
+    Telemetry<StepRecord> *telemetry = nullptr;
+
+    explicit LSMPS(int Nx)
+        : Nx(Nx), N(Nx * Nx), Nw(3 * Nx / 2), Nb(4 * Nw), grid_res(std::max(Nx / 2, 1)),
+          n_cells(grid_res * grid_res), dx(1.0 / grid_res), dx_inv(grid_res)
+    {
+        X.resize(N);
+        V.resize(N);
+        V_a.resize(N);
+        V_star.resize(N);
+        Label.resize(N);
+        M.resize(N);
+        M_n.resize(N);
+        M_hat.resize(N);
+        M_inv.resize(N);
+        MN_inv.resize(N);
+        M_hat_inv.resize(N);
+        cell_begin.resize(n_cells + 1);
+        cell_particles.resize(N);
+        id.resize(N);
+        pair_begin.resize(N + 1);
+        X_built.resize(N);
+        X_b.resize(Nb);
+        N_b.resize(Nb);
+        rhs.setZero(N);
+        Pdt.setZero(N);
+        init();
+    }
+
+    real W(real r) const
+    {
+        real ret = 0.0;
+        if (r < re)
+            ret = pow(1 - r / re, 2);
+        return ret;
+    }
+
+    real Wa(real r) const
+    {
+        real ret = 0.0;
+        if (r < re)
+            ret = re / r - 1;
+        return ret;
+    };
+
+    real Wup(real r, real costheta) const
     {
-        V_star[i] = V[i] - dt * 1e-1 * (X[i] - Vec2(0.5, 0.5));
-        Mat<5> m_inv = M[i].inverse();
-        Mat<2, 5> v_grad = Mat<2, 5>::Zero();
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
+        return W(r) * std::max(2 * costheta * costheta - 1, eps);
+    }
+
+    Vec<5> P(const Vec2 &r) const
+    {
+        Vec<5> ret;
+        ret << r(0), r(1), r(0) * r(0), r(0) * r(1), r(1) * r(1);
+        return ret;
+    }
+
+    Vec<6> Phat(const Vec<2> &r) const
+    {
+        Vec<6> ret;
+        ret << 1, r(0), r(1), r(0) * r(0), r(0) * r(1), r(1) * r(1);
+        return ret;
+    }
+
+    Vec<5> Q(const Vec2 &r, const Vec2 &n) const
+    {
+        Vec<5> ret;
+        ret << n[0], n[1], 2 * n[0] * r[0], (n[0] * r[1] + n[1] * r[0]), 2 * n[1] * r[0];
+        return ret;
+    }
+
+    bool valid_cell(const Vec2i &c)
+    {
+        return (c[0] >= 0) && (c[0] < grid_res) && (c[1] >= 0) && (c[1] < grid_res);
+    }
+
+    bool near_boundary(const Vec2 &r)
+    {
+        return (r[0] < bound_min[0] + re) || (r[0] > bound_max[0] - re) ||
+               (r[1] < bound_min[1] + re) || (r[1] > bound_max[1] - re);
+    }
+
+    // Bins hidden by a neighbor at dX: rangeb bins from lowb, truncated from the
+    // angles in degrees as the screen always did. The polynomial angles decide
+    // unless a truncation lies within their error of an integer or the direction
+    // is at the -180/180 degree seam; then atan2 does, so the labels are the same.
+    void screen_bins(const Vec2 &dX, int &lowb, int &rangeb)
+    {
+        const real deg = 180.0 / PI, margin = 2e-5; // Degrees, for two angles
+        real w2 = dX.dot(dX) - 0.25 * l0 * l0;
+        if (w2 < 0) // Closer than l0 / 2: the angles are NaN, nothing is hidden
+        {
+            rangeb = 0;
+            return;
+        }
+        real theta_ij = deg * (atan2_approx(dX[1], dX[0]) + PI);
+        real dtheta_ij = deg * atan2_approx(0.5 * l0, sqrt(w2));
+        auto stable = [&](real v) { return static_cast<int>(v - margin) == static_cast<int>(v + margin); };
+        if (!(theta_ij > margin && theta_ij < 360 - margin && stable(theta_ij - dtheta_ij) && stable(2 * dtheta_ij)))
+        {
+            theta_ij = deg * (std::atan2(dX[1], dX[0]) + PI);
+            dtheta_ij = deg * std::atan2(0.5 * l0, sqrt(w2));
+        }
+        lowb = static_cast<int>(theta_ij - dtheta_ij) % N_screen;
+        rangeb = static_cast<int>(2 * dtheta_ij);
+    }
+
+    // No Label 1 particle within re of particle i. The neighbor list holds
+    // every particle that close, so only i's pairs are scanned.
+    bool far_from_surface(int i)
+    {
+        for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
+            if (Label[pairs[p].j] == 1 && pairs[p].r < re)
+                return false;
+        return true;
+    }
+
+    Vec2i cell_coord(const Vec2 &r) // Outside the grid: the nearest border cell
+    {
+        Vec2i c = (r * dx_inv).cast<int>();
+        return c.cwiseMax(0).cwiseMin(grid_res - 1);
+    }
+
+    template <typename T>
+    void permute(T &a, T &old) // a[k] = a[cell_particles[k]], old is scratch
+    {
+        old = a;
+        taichi::parallel_for(0, N, [&](int k) { a[k] = old[cell_particles[k]]; });
+    }
+
+    // Counting sort by cell, in chunks of particles that count and scatter in
+    // parallel; chunk c writes behind chunks 0..c-1 in every cell, so the order
+    // within a cell stays the index order. No per-cell capacity limit.
+    void build_cell_list()
+    {
+        const int chunks = 64;
+        auto chunk = [&](int c) { return N * c / chunks; };
+        chunk_count.assign(n_cells * chunks, 0);
+        particle_cell.resize(N);
+        taichi::parallel_for(0, chunks, [&](int c) {
+            for (int i = chunk(c); i < chunk(c + 1); ++i)
+            {
+                Vec2i coord = cell_coord(X[i]);
+                particle_cell[i] = coord[0] * grid_res + coord[1];
+                ++chunk_count[particle_cell[i] * chunks + c];
+            }
+        }, 1);
+        for (int k = 0, sum = 0; k < n_cells * chunks; ++k) // Exclusive scan
+        {
+            if (k % chunks == 0)
+                cell_begin[k / chunks] = sum;
+            int c = chunk_count[k];
+            chunk_count[k] = sum;
+            sum += c;
+        }
+        cell_begin[n_cells] = N;
+        taichi::parallel_for(0, chunks, [&](int c) {
+            for (int i = chunk(c); i < chunk(c + 1); ++i)
+                cell_particles[chunk_count[particle_cell[i] * chunks + c]++] = i;
+        }, 1);
+        if (!sort_particles)
+            return;
+        permute(X, old_vec2); // Neighbors in space become neighbors in memory
+        permute(V, old_vec2);
+        permute(V_star, old_vec2); // Still needed by solve_pressure() and projection()
+        permute(Label, old_char);
+        permute(Pdt, old_real);
+        permute(id, old_int);
+        for (int k = 0; k < N; ++k)
+            cell_particles[k] = k;
+        gmres_amg.preconditioner().invalidate(); // Its aggregates are in the old order
+    }
+
+    template <typename F>
+    void for_each_candidate(int i, const F &f) // Particles in the 9 cells around i
+    {
+        Vec2i coord = cell_coord(X[i]);
         for (int d = 0; d < 9; ++d)
         {
             Vec2i nb = coord + nb_dirs[d];
             if (!valid_cell(nb))
                 continue;
-            Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-            for (int p = 1; p <= bucket[0]; ++p)
+            int cell = nb[0] * grid_res + nb[1];
+            for (int k = cell_begin[cell]; k < cell_begin[cell + 1]; ++k)
+                f(cell_particles[k]);
+        }
+    }
+
+    void refresh_pairs()
+    {
+        taichi::parallel_for(0, N, [&](int i) {
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
             {
-                int j = bucket[p];
-                if (i == j)
-                    continue;
-                Vec2 rij = X[j] - X[i];
-                real costheta = rij.normalized().dot((V_a[i] - V[i]).normalized());
-                v_grad += rij * (Hrs * m_inv * Wup(rij.norm(), costheta) * P(rij / rs)).transpose();
+                Pair &pair = pairs[p];
+                pair.rij = X[pair.j] - X[i];
+                pair.r = pair.rij.norm();
+                pair.w = W(pair.r);
+                pair.wa = Wa(pair.r); // inf for the self pair, never used
+            }
+        });
+    }
+
+    // Calls f(j, X_b[j] - x) for the wall particles j within re of x, in index
+    // order. Per wall, only the interval around the projection of x is tested.
+    template <typename F>
+    void for_each_wall_particle(const Vec2 &x, const F &f)
+    {
+        for (int w = 0; w < 4; ++w)
+        {
+            Vec2 d = x - wall_origin[w];
+            if (std::abs(d.dot(wall_normal[w])) > re)
+                continue;
+            real t = d.dot(wall_dir[w]) / wall_spacing, range = re / wall_spacing;
+            int lo = std::max(static_cast<int>(std::floor(t - range)), 0);
+            int hi = std::min(static_cast<int>(std::ceil(t + range)), Nw - 1);
+            for (int k = lo; k <= hi; ++k)
+            {
+                int j = w * Nw + k;
+                Vec2 rij = X_b[j] - x;
+                if (rij.norm() <= re)
+                    f(j, rij);
             }
         }
-        V_star[i] += v_grad * H1_inv * P(dt * (V_a[i] - V[i]));
     }
-}
 
-void update_position()
-{
-    for (int i = 0; i < N; ++i)
+    // Clamped so that re + skin <= dx: the list only scans the 9 cells around i.
+    // Rebuilds the list, which may have been built with a smaller cutoff.
+    void set_skin(real value)
     {
-        X[i] += V_a[i] * dt;
+        real old = skin;
+        skin = std::max(real(0), std::min(value, dx - re));
+        if (skin != value)
+            std::cerr << "skin " << value << " clamped to " << skin << " (re + skin <= dx)" << std::endl;
+        if (skin != old)
+            update_neighbors(true);
     }
-}
 
-void solve_pressure()
-{
-    //TODO: solve pressure
-    Laplacian.setZero();
-    Laplacian.resize(N, N);
-    rhs.setZero();
-    triplets.clear();
-    for (int i = 0; i < N; ++i)
-    {
-        if (Label[i] == 2)
+    void update_neighbors(bool rebuild = false)
+    {
+        if (!rebuild && skin > 0)
         {
-            triplets.push_back(Triplet(i, i, 1.0));
-            continue;
+            real max_d2 = taichi::parallel_reduce(
+                0, N, 0.0, [&](int i) { return (X[i] - X_built[i]).squaredNorm(); },
+                [](real a, real b) { return std::max(a, b); });
+            rebuild = 4 * max_d2 > skin * skin;
         }
-        Mat<5> m_inv = M[i].inverse();
-        Mat<5> mn_inv;
-        if (Label[i] == 1)
-            mn_inv = (M[i] + M_n[i]).inverse();
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
-        real dig = 0.0;
-        for (int d = 0; d < 9; ++d)
+        if (!rebuild && skin > 0)
         {
-            Vec2i nb = coord + nb_dirs[d];
-            if (!valid_cell(nb))
-                continue;
-            Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-            for (int p = 1; p <= bucket[0]; ++p)
+            refresh_pairs();
+            return;
+        }
+        build_cell_list();
+        assert(re + skin <= dx); // Backstop for set_skin(): candidates come from 9 cells
+        const real cutoff = re + skin;
+        taichi::parallel_for(0, N, [&](int i) { // Count, scan, then fill
+            int count = 0;
+            for_each_candidate(i, [&](int j) { count += (X[j] - X[i]).norm() <= cutoff; });
+            pair_begin[i + 1] = count;
+        });
+        pair_begin[0] = 0;
+        for (int i = 0; i < N; ++i)
+            pair_begin[i + 1] += pair_begin[i];
+        pairs.resize(pair_begin[N]);
+        taichi::parallel_for(0, N, [&](int i) {
+            int p = pair_begin[i];
+            for_each_candidate(i, [&](int j) {
+                if ((X[j] - X[i]).norm() <= cutoff)
+                    pairs[p++].j = j;
+            });
+        });
+        X_built = X;
+        refresh_pairs();
+    }
+
+    void update_label()
+    {
+        std::fill(Label.begin(), Label.end(), 0);
+        taichi::parallel_for(0, N, [&](int i) {
+            if (near_boundary(X[i]))
+                Label[i] = 1;
+            else
             {
-                int j = bucket[p];
-                if (i == j)
-                    continue;
-                Vec2 rij = X[j] - X[i];
-                if (Label[i] == 1)
+                AngularScreen screen;
+                for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
                 {
-                    Vec<5> partial = Hrs * mn_inv * W(rij.norm()) * P(rij / rs);
-                    if (Label[j] != 2)
-                        triplets.push_back(Triplet(i, j, -partial[2] - partial[4]));
-                    dig += (partial[2] + partial[4]);
+                    const Pair &pair = pairs[p];
+                    int j = pair.j;
+                    if (i == j)
+                        continue;
+                    if (pair.r > re)
+                        continue;
+                    int lowb, rangeb;
+                    screen_bins(pair.rij, lowb, rangeb);
+                    if (rangeb > 0)
+                        screen.set((lowb + N_screen) % N_screen, rangeb);
                 }
-                else
+                int n_block = screen.count();
+                if (static_cast<double>(n_block) / N_screen < 5.0 / 6.0)
+                    Label[i] = 2;
+            }
+        });
+    }
+
+    void compute_M()
+    {
+        taichi::parallel_for(0, N, [&](int i) {
+            M[i] = Mat<5>::Zero();
+            M_hat[i] = Mat<6>::Zero();
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
+            {
+                const Pair &pair = pairs[p];
+                int j = pair.j;
+                if (i == j)
                 {
-                    Vec<5> partial = Hrs * m_inv * W(rij.norm()) * P(rij / rs);
-                    if (Label[j] != 2)
-                        triplets.push_back(Triplet(i, j, -partial[2] - partial[4]));
-                    dig += (partial[2] + partial[4]);
+                    Vec<6> phat = Phat(Vec2::Zero());
+                    if (near_boundary(X[i]) || far_from_surface(i))
+                        M_hat[i] += W(0) * phat * phat.transpose();
+                    continue;
                 }
+                Vec<5> pij = P(pair.rij / rs);
+                Vec<6> phat = Phat(pair.rij / rs);
+                M[i] += pair.w * pij * pij.transpose();
+                M_hat[i] += pair.w * phat * phat.transpose();
+            }
+        });
+        taichi::parallel_for(0, N, [&](int i) {
+            if (!near_boundary(X[i]))
+                return;
+            M_n[i] = Mat<5>::Zero();
+            for_each_wall_particle(X[i], [&](int j, const Vec2 &rij) {
+                Vec<5> qij = Q(rij / rs, N_b[j]);
+                M_n[i] += W(rij.norm()) * qij * qij.transpose();
+            });
+        });
+        taichi::parallel_for(0, N, [&](int i) {
+            M_inv[i] = M[i].inverse();
+            M_hat_inv[i] = M_hat[i].inverse();
+            if (near_boundary(X[i]))
+                MN_inv[i] = (M[i] + M_n[i]).inverse();
+        });
+    }
+
+    void init()
+    {
+        Hrs.diagonal() << 1 / rs, 1 / rs, 2 / (rs * rs), 1 / (rs * rs), 2 / (rs * rs);
+        Hhat.diagonal() << 1, 1 / rs, 1 / rs, 2 / (rs * rs), 1 / (rs * rs), 2 / (rs * rs);
+        H1_inv.diagonal() << 1, 1, 0.5, 1, 0.5;
+        //free particles
+        std::fill(V.begin(), V.end(), Vec2::Zero());
+        for (int i = 0; i < N; ++i)
+            id[i] = i;
+        real tdx = R / Nx;
+        n0 = 0.0;
+        Vec2 ref_X = Vec2(0.5 - R / 2 + tdx * (Nx / 2), 0.5 - R / 2 + tdx * (Nx / 2));
+        for (int i = 0; i < Nx; ++i)
+        {
+            for (int j = 0; j < Nx; ++j)
+            {
+                X[i * Nx + j] = Vec2(0.5 - R / 2 + tdx * i, 0.5 - R / 2 + tdx * j);
+                if ((i != Nx / 2) || (j != Nx / 2))
+                    n0 += Wa((X[i * Nx + j] - ref_X).norm());
             }
         }
-        triplets.push_back(Triplet(i, i, dig));
-        if (Label[i] != 1)
-            continue;
-        Vec<5> rhs_i = Vec<5>::Zero();
-        for (int j = 0; j < Nb; ++j)
+
+        //wall boundary
+        real tdw = (bound_max[0] - bound_min[0]) / Nw;
+        Vec2 norms[4] = {Vec2(0.0, 1.0), Vec2(-1.0, 0.0), Vec2(0.0, -1.0), Vec2(1.0, 0.0)};
+        Vec2 dirs[4] = {Vec2(1.0, 0.0), Vec2(0.0, 1.0), Vec2(-1.0, 0.0), Vec2(0.0, -1.0)};
+        Vec2 offsets[4] = {Vec2(bound_min[0] + tdw / 2, bound_min[1]), Vec2(bound_max[0], bound_min[1] + tdw / 2),
+                           Vec2(bound_max[0] - tdw / 2, bound_max[1]), Vec2(bound_min[0], bound_max[1] - tdw / 2)};
+        for (int i = 0; i < Nw; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                N_b[j * Nw + i] = norms[j];
+                X_b[j * Nw + i] = offsets[j] + i * tdw * dirs[j];
+            }
+        }
+        std::copy(offsets, offsets + 4, wall_origin);
+        std::copy(dirs, dirs + 4, wall_dir);
+        std::copy(norms, norms + 4, wall_normal);
+        wall_spacing = tdw;
+        update_neighbors(true);
+        compute_M();
+        update_label();
+    }
+
+    void particle_shifting()
+    {
+        taichi::parallel_for(0, N, [&](int i) {
+            Vec2 delta = Vec2::Zero();
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
+            {
+                const Pair &pair = pairs[p];
+                int j = pair.j;
+                real rij = pair.r;
+                if (j != i)
+                    delta -= alpha * l0 * l0 * 2 / n0 * pair.wa * pair.rij / (rij * rij);
+            }
+            V_a[i] = V[i] + delta / dt;
+        });
+    }
+
+    void advection_and_force()
+    {
+        taichi::parallel_for(0, N, [&](int i) {
+            V_star[i] = V[i] - dt * 1e-1 * (X[i] - Vec2(0.5, 0.5));
+            const Mat<5> &m_inv = M_inv[i];
+            Mat<2, 5> v_grad = Mat<2, 5>::Zero();
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
+            {
+                const Pair &pair = pairs[p];
+                int j = pair.j;
+                if (i == j)
+                    continue;
+                const Vec2 &rij = pair.rij;
+                real costheta = rij.normalized().dot((V_a[i] - V[i]).normalized());
+                v_grad += rij * (Hrs * m_inv * Wup(pair.r, costheta) * P(rij / rs)).transpose();
+            }
+            V_star[i] += v_grad * H1_inv * P(dt * (V_a[i] - V[i]));
+        });
+    }
+
+    void update_position()
+    {
+        taichi::parallel_for(0, N, [&](int i) {
+            X[i] += V_a[i] * dt;
+        });
+    }
+
+    real laplacian_coef(int i, const Pair &pair) const
+    {
+        return pair.w * lap_g[i].dot(P(pair.rij / rs));
+    }
+
+    void assemble_row(int i, const Mat<5> &m_inv)
+    {
+        real dig = 0.0;
+        for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
         {
-            Vec2 rij = X_b[j] - X[i];
-            if (rij.norm() > re)
+            const Pair &pair = pairs[p];
+            int j = pair.j;
+            if (i == j)
                 continue;
-            real p_n = rho * V_star[i].dot(N_b[j]);
-            rhs_i += Hrs * mn_inv * W(rij.norm()) * Q(rij / rs, N_b[j]) * rs * p_n;
+            const Vec2 &rij = pair.rij;
+            Vec<5> partial = Hrs * m_inv * pair.w * P(rij / rs);
+            if (Label[j] != 2)
+                triplets.push_back(Triplet(i, j, -partial[2] - partial[4]));
+            dig += (partial[2] + partial[4]);
         }
-        rhs[i] += (rhs_i[2] + rhs_i[4]);
+        triplets.push_back(Triplet(i, i, dig));
     }
 
-    for (int i = 0; i < N; ++i)
+    void set_operator_row(int i, const Mat<5> &m_inv) // Matrix-free counterpart of assemble_row()
     {
-        if (Label[i] == 2)
-            continue;
-        Mat<6> m_inv = M_hat[i].inverse();
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
-        real div_v = 0.0;
-        for (int d = 0; d < 9; ++d)
+        Mat<5> a = Hrs * m_inv;
+        lap_g[i] = (a.row(2) + a.row(4)).transpose();
+        real dig = 0.0;
+        for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
         {
-            Vec2i nb = coord + nb_dirs[d];
-            if (!valid_cell(nb))
+            if (pairs[p].j != i)
+                dig += laplacian_coef(i, pairs[p]);
+        }
+        laplacian_diag[i] = dig;
+    }
+
+    template <typename Vx, typename Vy>
+    void apply_laplacian(const Vx &x, Vy &y, real alpha) const // y += alpha * Laplacian * x
+    {
+        taichi::parallel_for(0, N, [&](int i) {
+            if (Label[i] == 2)
+            {
+                y.coeffRef(i) += alpha * x.coeff(i);
+                return;
+            }
+            real sum = laplacian_diag[i] * x.coeff(i);
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
+            {
+                const Pair &pair = pairs[p];
+                if (pair.j != i && Label[pair.j] != 2)
+                    sum -= laplacian_coef(i, pair) * x.coeff(pair.j);
+            }
+            y.coeffRef(i) += alpha * sum;
+        });
+    }
+
+    void solve_pressure()
+    {
+        //TODO: solve pressure
+        Laplacian.setZero();
+        Laplacian.resize(N, N);
+        rhs.setZero();
+        triplets.clear();
+        if (matrix_free)
+        {
+            lap_g.resize(N);
+            laplacian_diag.resize(N);
+        }
+        for (int i = 0; i < N; ++i)
+        {
+            if (Label[i] == 2)
+            {
+                if (matrix_free)
+                    laplacian_diag[i] = 1.0;
+                else
+                    triplets.push_back(Triplet(i, i, 1.0));
+                continue;
+            }
+            const Mat<5> &m_inv = M_inv[i], &mn_inv = MN_inv[i];
+            if (matrix_free)
+                set_operator_row(i, Label[i] == 1 ? mn_inv : m_inv);
+            else
+                assemble_row(i, Label[i] == 1 ? mn_inv : m_inv);
+            if (Label[i] != 1)
                 continue;
-            Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-            for (int p = 1; p <= bucket[0]; ++p)
+            Vec<5> rhs_i = Vec<5>::Zero();
+            for_each_wall_particle(X[i], [&](int j, const Vec2 &rij) {
+                real p_n = rho * V_star[i].dot(N_b[j]);
+                rhs_i += Hrs * mn_inv * W(rij.norm()) * Q(rij / rs, N_b[j]) * rs * p_n;
+            });
+            rhs[i] += (rhs_i[2] + rhs_i[4]);
+        }
+
+        taichi::parallel_for(0, N, [&](int i) {
+            if (Label[i] == 2)
+                return;
+            const Mat<6> &m_inv = M_hat_inv[i];
+            real div_v = 0.0;
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
             {
-                int j = bucket[p];
+                const Pair &pair = pairs[p];
+                int j = pair.j;
                 if ((i == j) && (!near_boundary(X[i])))
                     continue;
-                Vec<2> rij = X[j] - X[i];
-                Vec<6> partial = Hhat * m_inv * W(rij.norm()) * Phat(rij / rs);
+                const Vec2 &rij = pair.rij;
+                Vec<6> partial = Hhat * m_inv * pair.w * Phat(rij / rs);
                 div_v += (partial[1] * V_star[j][0] + partial[2] * V_star[j][1]);
             }
+            rhs[i] -= rho * div_v;
+        });
+        auto solve = [&](auto &solver) {
+            Pdt = solver.solve(rhs);
+            pressure_stats = {static_cast<int>(solver.iterations()), solver.error()};
+        };
+        if (matrix_free) // Jacobi-preconditioned even when amg is set
+        {
+            LaplacianOperator<LSMPS> op{};
+            op.solver = this;
+            Eigen::GMRES<LaplacianOperator<LSMPS>, OperatorJacobi> solver(op);
+            solve(solver);
+            return;
         }
-        rhs[i] -= rho * div_v;
+        Laplacian.setFromTriplets(triplets.begin(), triplets.end());
+        if (amg)
+        {
+            gmres_amg.compute(Laplacian);
+            solve(gmres_amg);
+            return;
+        }
+        Eigen::GMRES<SpMat> solver(Laplacian);
+        solve(solver);
     }
-    Laplacian.setFromTriplets(triplets.begin(), triplets.end());
-    Eigen::GMRES<SpMat> solver(Laplacian);
-    Pdt = solver.solve(rhs);
-    std::cout << "[iters: " << solver.iterations() << " error: " << solver.error() << "]" << std::endl;
-}
 
-void projection()
-{
-    for (int i = 0; i < N; ++i)
-    {
-        Vec2 grad_p = Vec2::Zero();
-        bool is_near_boundary = near_boundary(X[i]);
-        Mat<5> m_inv = M[i].inverse();
-        Mat<5> mn_inv;
-        if (is_near_boundary)
-            mn_inv = (M[i] + M_n[i]).inverse();
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
-        for (int d = 0; d < 9; ++d)
-        {
-            Vec2i nb = coord + nb_dirs[d];
-            if (!valid_cell(nb))
-                continue;
-            Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-            for (int p = 1; p <= bucket[0]; ++p)
+    void projection()
+    {
+        taichi::parallel_for(0, N, [&](int i) {
+            Vec2 grad_p = Vec2::Zero();
+            bool is_near_boundary = near_boundary(X[i]);
+            const Mat<5> &m_inv = M_inv[i], &mn_inv = MN_inv[i];
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
             {
-                int j = bucket[p];
+                const Pair &pair = pairs[p];
+                int j = pair.j;
                 if (i == j)
                     continue;
-                Vec2 rij = X[j] - X[i];
+                const Vec2 &rij = pair.rij;
                 if (is_near_boundary)
                 {
-                    Vec<5> partial = Hrs * mn_inv * W(rij.norm()) * P(rij / rs);
+                    Vec<5> partial = Hrs * mn_inv * pair.w * P(rij / rs);
                     grad_p += partial.segment<2>(0) * (Pdt[j] - Pdt[i]);
                 }
                 else
                 {
-                    Vec<5> partial = Hrs * m_inv * W(rij.norm()) * P(rij / rs);
+                    Vec<5> partial = Hrs * m_inv * pair.w * P(rij / rs);
                     grad_p += partial.segment<2>(0) * (Pdt[j] - Pdt[i]);
                 }
             }
-        }
-        if (is_near_boundary)
-        {
-            for (int j = 0; j < Nb; ++j)
+            if (is_near_boundary)
             {
-                Vec2 rij = X_b[j] - X[i];
-                if (rij.norm() > re)
-                    continue;
-                real p_n = rho * V_star[i].dot(N_b[j]);
-                grad_p += (Hrs * mn_inv * W(rij.norm()) * Q(rij / rs, N_b[j])).segment<2>(0) * rs * p_n;
+                for_each_wall_particle(X[i], [&](int j, const Vec2 &rij) {
+                    real p_n = rho * V_star[i].dot(N_b[j]);
+                    grad_p += (Hrs * mn_inv * W(rij.norm()) * Q(rij / rs, N_b[j])).segment<2>(0) * rs * p_n;
+                });
             }
-        }
-        V[i] = V_star[i] - 1.0 / rho * grad_p;
+            V[i] = V_star[i] - 1.0 / rho * grad_p;
+        });
+    }
+
+    void advance()
+    {
+        double t = taichi::Time::get_time();
+        int phase = 0;
+        auto lap = [&] { // The time since the last lap goes to the next phase
+            double now = taichi::Time::get_time();
+            step.phase_time[phase++] = now - t;
+            t = now;
+        };
+        particle_shifting();
+        lap();
+        advection_and_force();
+        lap();
+        update_position();
+        lap();
+        update_neighbors();
+        lap();
+        update_label();
+        lap();
+        compute_M();
+        lap();
+        solve_pressure();
+        lap();
+        projection();
+        lap();
+        record_step();
+    }
+
+    void record_step()
+    {
+        step.frame = current_frame;
+        step.pressure = pressure_stats;
+        step.pairs = pair_begin[N];
+        std::fill(std::begin(step.labels), std::end(step.labels), 0);
+        for (char l : Label)
+            ++step.labels[static_cast<int>(l)];
+        if (telemetry)
+            telemetry->push(step);
+    }
+
+    // Checkpoint <base>.tcb: {next frame, N, X, V, Label, Pdt, id}, one bulk copy
+    // per array. Written to a temporary file first, so a crash while writing
+    // keeps the previous checkpoint. Returns false if a checkpoint being read
+    // has another N or is shorter than N calls for.
+    template <bool writing>
+    bool serialize(taichi::BinarySerializer<writing> &s, int &frame)
+    {
+        int n = N;
+        if (!writing && s.head + 2 * sizeof(int) > s.preserved)
+            return false;
+        s(frame);
+        s(n);
+        std::size_t bytes = s.head + std::size_t(N) * (2 * sizeof(Vec2) + sizeof(char) + sizeof(real) + sizeof(int));
+        if (n != N || (!writing && bytes > s.preserved)) // Checked before any bulk read
+            return false;
+        s.bulk(X.data(), N);
+        s.bulk(V.data(), N);
+        s.bulk(Label.data(), N);
+        s.bulk(Pdt.data(), N);
+        s.bulk(id.data(), N);
+        return true;
+    }
+};
+
+// Command line options, which may come anywhere among the positional
+// arguments: --matrix-free applies the pressure Laplacian without assembling
+// it, --amg preconditions GMRES with algebraic multigrid (ignored with
+// --matrix-free, which uses Jacobi), --skin <s> keeps the neighbor list until
+// a particle has moved s / 2 (clamped to re + s <= dx), --sort reorders the
+// particle arrays into cell order at every list rebuild, --telemetry <path>
+// writes per-step metrics as CSV ("-": stdout).
+struct Options
+{
+    bool matrix_free = false, amg = false, sort = false;
+    real skin = 0;
+    std::string telemetry;
+};
+
+std::vector<std::string> parse_args(int argc, char *argv[], Options &options)
+{
+    std::vector<std::string> args;
+    for (int k = 1; k < argc; ++k)
+    {
+        std::string arg = argv[k];
+        if (arg == "--matrix-free")
+            options.matrix_free = true;
+        else if (arg == "--amg")
+            options.amg = true;
+        else if (arg == "--sort")
+            options.sort = true;
+        else if (arg == "--skin" && k + 1 < argc)
+            options.skin = std::stod(argv[++k]);
+        else if (arg == "--telemetry" && k + 1 < argc)
+            options.telemetry = argv[++k];
+        else
+            args.push_back(arg);
     }
+    if (options.matrix_free && options.amg)
+        std::cerr << "--amg needs the assembled matrix, using Jacobi with --matrix-free" << std::endl;
+    return args;
 }
 
-void advance()
+#if defined(TC_HEADLESS)
+// Batch mode: a fixed number of frames as fast as possible, each frame's
+// state written to <prefix>NNNNN.bin as {int N; Vec2 X[N], V[N]; char Label[N]}
+void dump_frame(const LSMPS &lsmps, const std::string &path)
 {
-    std::cout << current_frame << " : " << std::flush;
-    particle_shifting();
-    advection_and_force();
-    update_position();
-    reset_hashing();
-    update_label();
-    compute_M();
-    solve_pressure();
-    projection();
+    FILE *f = std::fopen(path.c_str(), "wb");
+    if (!f)
+    {
+        std::cerr << "cannot write " << path << std::endl;
+        return;
+    }
+    int n = lsmps.N;
+    Array<Vec2> x(n), v(n); // In seeding order
+    std::vector<char> label(n);
+    for (int i = 0; i < n; ++i)
+    {
+        x[lsmps.id[i]] = lsmps.X[i];
+        v[lsmps.id[i]] = lsmps.V[i];
+        label[lsmps.id[i]] = lsmps.Label[i];
+    }
+    std::fwrite(&n, sizeof(n), 1, f);
+    std::fwrite(x.data(), sizeof(Vec2), n, f);
+    std::fwrite(v.data(), sizeof(Vec2), n, f);
+    std::fwrite(label.data(), sizeof(char), n, f);
+    std::fclose(f);
+}
+
+void save_checkpoint(LSMPS &lsmps, const std::string &base, int frame)
+{
+    taichi::BinaryOutputSerializer s;
+    s.initialize();
+    lsmps.serialize(s, frame);
+    s.finalize();
+    s.write_to_file(base + ".tmp.tcb");
+    std::rename((base + ".tmp.tcb").c_str(), (base + ".tcb").c_str());
+}
+
+int load_checkpoint(LSMPS &lsmps, const std::string &base) // returns the next frame
+{
+    if (!std::ifstream(base + ".tcb"))
+        return 0;
+    taichi::BinaryInputSerializer s;
+    s.initialize(base + ".tcb");
+    int frame = 0;
+    if (!lsmps.serialize(s, frame))
+    {
+        std::cerr << base << ".tcb: other N, or truncated, starting over" << std::endl;
+        return 0;
+    }
+    s.finalize();
+    lsmps.update_neighbors(true); // Neighbors and M follow from X and Label
+    lsmps.compute_M();
+    return frame;
 }
 
-int main()
+// [frames] [output prefix] [checkpoint every K frames] [particles per side]
+int main(int argc, char *argv[])
+{
+    Options options;
+    auto args = parse_args(argc, argv, options);
+    int frames = args.size() > 0 ? std::stoi(args[0]) : 100;
+    std::string prefix = args.size() > 1 ? args[1] : "frame_";
+    int checkpoint_interval = args.size() > 2 ? std::stoi(args[2]) : 0;
+    LSMPS lsmps(args.size() > 3 ? std::stoi(args[3]) : 20);
+    lsmps.matrix_free = options.matrix_free;
+    lsmps.sort_particles = options.sort;
+    lsmps.set_skin(options.skin);
+    lsmps.amg = options.amg;
+    std::unique_ptr<Telemetry<StepRecord>> telemetry;
+    if (!options.telemetry.empty())
+    {
+        telemetry.reset(new Telemetry<StepRecord>(options.telemetry));
+        lsmps.telemetry = telemetry.get();
+    }
+    int first = checkpoint_interval > 0 ? load_checkpoint(lsmps, prefix + "checkpoint") : 0;
+    auto start = taichi::Time::get_time();
+    for (lsmps.current_frame = first; lsmps.current_frame < frames; ++lsmps.current_frame)
+    {
+        int frame = lsmps.current_frame;
+        lsmps.advance();
+        dump_frame(lsmps, prefix + fmt::format("{:05d}.bin", frame));
+        if (checkpoint_interval > 0 && (frame + 1) % checkpoint_interval == 0)
+            save_checkpoint(lsmps, prefix + "checkpoint", frame + 1);
+    }
+    real t = taichi::Time::get_time() - start;
+    std::cout << frames - first << " frames, " << frames - first << " steps in " << t << " s: "
+              << (frames - first) / t << " steps/s" << std::endl;
+    return 0;
+}
+#else
+int main(int argc, char *argv[]) // [particles per side]
 {
-    init();
-    std::cout << "re: " << re << " dx: " << dx << std::endl;
+    Options options;
+    auto args = parse_args(argc, argv, options);
+    LSMPS lsmps(args.size() > 0 ? std::stoi(args[0]) : 20);
+    lsmps.matrix_free = options.matrix_free;
+    lsmps.sort_particles = options.sort;
+    lsmps.set_skin(options.skin);
+    lsmps.amg = options.amg;
+    std::cout << "re: " << lsmps.re << " dx: " << lsmps.dx << std::endl;
+    Telemetry<StepRecord> telemetry(options.telemetry.empty() ? "-" : options.telemetry);
+    lsmps.telemetry = &telemetry;
     taichi::GUI gui("LSMPS", window_size, window_size);
     auto &canvas = gui.get_canvas();
-    for (current_frame = 0;; ++current_frame)
+    for (;; ++lsmps.current_frame)
     {
-        advance();
+        lsmps.advance();
         canvas.clear(0x112F41);
         //canvas.rect(taichi::Vector2(0.04), taichi::Vector2(0.96)).radius(2).color(0x4FB99F).close();
-        for (int i = 0; i < N; ++i)
-            canvas.circle(X[i][0], X[i][1]).radius(2).color(colors[Label[i]]);
-        for (int i = 0; i < Nb; ++i)
-            canvas.circle(X_b[i][0], X_b[i][1]).radius(2).color(0x99CDCD);
+        for (int i = 0; i < lsmps.N; ++i)
+            canvas.circle(lsmps.X[i][0], lsmps.X[i][1]).radius(2).color(colors[lsmps.Label[i]]);
+        for (int i = 0; i < lsmps.Nb; ++i)
+            canvas.circle(lsmps.X_b[i][0], lsmps.X_b[i][1]).radius(2).color(0x99CDCD);
         gui.update();
     }
-}
\ No newline at end of file
+}
+#endif
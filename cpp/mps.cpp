@@ -4,370 +4,1216 @@
 #include <vector>
 #include <array>
 #include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
 
 #include <Eigen/Sparse>
 #include <Eigen/Dense>
 #include <unsupported/Eigen/SparseExtra>
 #include <unsupported/Eigen/IterativeSolvers>
+#include <Eigen/IterativeLinearSolvers>
 
 // Math Type
 using real = double;
 using Vec2 = Eigen::Matrix<real, 2, 1>;
 using Vec2i = Eigen::Vector2i;
 using Mat2 = Eigen::Matrix<real, 2, 2>;
-using SpMat = Eigen::SparseMatrix<real>;
-using Triplet = Eigen::Triplet<real>;
+using SpMat = Eigen::SparseMatrix<real, Eigen::RowMajor>; // CSR, filled row by row in parallel
 template <int d>
 using Vec = Eigen::Matrix<real, d, 1>;
 template <int m, int n = m>
 using Mat = Eigen::Matrix<real, m, n>;
+using VecX = Vec<Eigen::Dynamic>;
+template <typename T>
+using Array = std::vector<T, Eigen::aligned_allocator<T>>;
 #define PI 3.141592653589793238463
 
 // Constants
-// const int Nx = 20, N = Nx * Nx; // free particles
-// const int Nw = 30, Nb = 4 * Nw; // boundary particles
-// const int grid_res = 10, window_size = 800;
-const int Nx = 40, N = Nx * Nx; // free particles
-const int Nw = 60, Nb = 4 * Nw; // boundary particles
-const int grid_res = 20, window_size = 800;
-const int bucket_size = 64;
-const real dx = 1.0 / grid_res, dx_inv = (real)grid_res;
+const int window_size = 800;
 const real R = 0.5; //init rect side length
 const Vec2i nb_dirs[9] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1}};
 const int colors[4] = {0xED553B, 0xF2B134, 0x068587, 0x858706};
 const int N_screen = 360;
 
-//parameters
-real l0 = sqrt(R * R / N);
-real dt = 1e-2;
-Vec2 grav{0, -1.0};
-real re = 3.1 * l0;
-real n0; //reference particle density
-real lambda0;
-real gamma = 0.2;
-real rho = 1.0;
-Vec2 bound_min = Vec2(0.05, 0.05), bound_max = Vec2(0.95, 0.95);
-
-// Data
-int current_frame;
-std::array<Vec2, N> X, V;
-std::array<real, N> N_d;   //number density
-std::array<char, N> Label; // 0=free, 1=near wall boundary, 2=A, 3=B
-using Bucket = std::array<int, bucket_size>;
-std::array<Bucket, grid_res * grid_res> hashing;
-std::array<Vec2, Nb> X_b, N_b;
-std::vector<Triplet> triplets;
-SpMat Laplacian;
-Vec<N> rhs, Pdt;
-
-inline real Wa(real r)
+struct Pair // A neighbor j of particle i, see MPS::pairs
 {
-    // real ret = 0.0;
-    // if (r < re)
-    //     ret = re / r - 1;
-    // return ret;
-    real ret = 0.0;
-    if (r < re)
-        ret = pow(1 - r / re, 2);
-    return ret;
+    int j;
+    real r, wa;
+    Vec2 rij;
 };
 
-inline bool valid_cell(const Vec2i &c)
+// The Laplacian is symmetric, so conjugate gradients apply. CG starts from
+// the previous step's Pdt, which changes slowly; restarted GMRES stagnates
+// from such a guess and starts from zero as it always did.
+enum class PressureSolver
 {
-    return (c[0] >= 0) && (c[0] < grid_res) && (c[1] >= 0) && (c[1] < grid_res);
-}
+    GMRES,
+    CG_Jacobi, // Diagonal preconditioner
+    CG_IC,     // Incomplete Cholesky preconditioner
+    CG_AMG     // Algebraic multigrid preconditioner, see AMGPreconditioner
+};
+struct SolveStats
+{
+    int iterations;
+    real error; // Relative residual reached
+};
 
-inline bool near_boundary(const Vec2 &r)
+// Metrics of one MPS::advance(): plain data, so recording a step is a copy;
+// write() formats it on the telemetry drain thread.
+struct StepRecord
 {
-    return (r[0] < bound_min[0] + re) || (r[0] > bound_max[0] - re) ||
-           (r[1] < bound_min[1] + re) || (r[1] > bound_max[1] - re);
-}
+    int frame;
+    SolveStats pressure;
+    real phase_time[6]; // s: pre_update, neighbors, label, density, pressure, post_update
+    long long pairs;    // Neighbor list entries, self pairs included
+    int labels[4];      // Particles per Label value
+
+    static const char *header()
+    {
+        return "frame,iterations,error,t_pre_update,t_neighbors,t_label,t_density,t_pressure,t_post_update,"
+               "pairs,label0,label1,label2,label3";
+    }
+    void write(FILE *f) const
+    {
+        std::fprintf(f, "%d,%d,%.3e", frame, pressure.iterations, pressure.error);
+        for (real t : phase_time)
+            std::fprintf(f, ",%.3e", t);
+        std::fprintf(f, ",%lld", pairs);
+        for (int n : labels)
+            std::fprintf(f, ",%d", n);
+        std::fprintf(f, "\n");
+    }
+};
 
-void reset_hashing()
+// Free surface screen: N_screen one-degree bins around a particle, packed into
+// 64-bit words. Each neighbor hides the bins its disc covers as seen from i.
+struct AngularScreen
 {
-    std::fill(hashing.begin(), hashing.end(), Bucket{});
-    for (int i = 0; i < N; ++i)
+    uint64_t bits[(N_screen + 63) / 64] = {};
+
+    void set(int begin, int count) // Bins begin .. begin + count - 1, cyclic
     {
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
-        if (!valid_cell(coord))
+        int end = begin + count;
+        if (end > N_screen)
         {
-            std::cerr << "[Error]out of box" << std::endl;
-            exit(1);
+            set(0, end - N_screen);
+            end = N_screen;
         }
-        Bucket &bucket = hashing[coord[0] * grid_res + coord[1]];
-        if (bucket[0] >= bucket_size - 1)
+        for (int w = begin / 64; w * 64 < end; ++w)
         {
-            std::cerr << "[Error]bucket full" << std::endl;
-            exit(1);
+            int lo = std::max(begin - w * 64, 0), hi = std::min(end - w * 64, 64);
+            uint64_t upto_hi = hi == 64 ? ~uint64_t(0) : (uint64_t(1) << hi) - 1;
+            bits[w] |= upto_hi & ~((uint64_t(1) << lo) - 1);
         }
-        ++bucket[0];
-        bucket[bucket[0]] = i;
     }
+
+    int count() const
+    {
+        int n = 0;
+        for (uint64_t w : bits)
+            n += static_cast<int>(std::bitset<64>(w).count());
+        return n;
+    }
+};
+
+inline real atan2_approx(real y, real x) // |error| < 2e-8 (Abramowitz & Stegun 4.4.49)
+{
+    real ax = std::abs(x), ay = std::abs(y);
+    real t = std::min(ax, ay) / std::max(ax, ay), t2 = t * t;
+    real a = t * (1 + t2 * (-0.3333314528 + t2 * (0.1999355085 + t2 * (-0.1420889944 + t2 * (0.1065626393 +
+             t2 * (-0.0752896400 + t2 * (0.0429096138 + t2 * (-0.0161657367 + t2 * 0.0028662257))))))));
+    if (ay > ax)
+        a = PI / 2 - a;
+    if (x < 0)
+        a = PI - a;
+    return y < 0 ? -a : a;
 }
 
-void update_label()
+// Matrix-free Laplacian for Eigen's Krylov solvers, which only need products
+// with it: Solver::apply_laplacian() computes them from the cached pairs.
+template <typename Solver>
+struct LaplacianOperator;
+
+namespace Eigen
+{
+namespace internal
+{
+template <typename Solver>
+struct traits<LaplacianOperator<Solver>> : public traits<SparseMatrix<::real>> // real alone is Eigen::real()
 {
-    std::fill(Label.begin(), Label.end(), 0);
-    for (int i = 0; i < N; ++i)
+};
+} // namespace internal
+} // namespace Eigen
+
+template <typename Solver>
+struct LaplacianOperator : public Eigen::EigenBase<LaplacianOperator<Solver>>
+{
+    using Scalar = real;
+    using RealScalar = real;
+    using StorageIndex = int;
+    enum
     {
-        bool screen[N_screen];
-        std::fill(screen, screen + N_screen, false);
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
-        for (int d = 0; d < 9; ++d)
+        ColsAtCompileTime = Eigen::Dynamic,
+        MaxColsAtCompileTime = Eigen::Dynamic,
+        IsRowMajor = false
+    };
+
+    const Solver *solver;
+
+    Eigen::Index rows() const { return solver->N; }
+    Eigen::Index cols() const { return solver->N; }
+
+    template <typename Rhs>
+    Eigen::Product<LaplacianOperator, Rhs, Eigen::AliasFreeProduct> operator*(const Eigen::MatrixBase<Rhs> &x) const
+    {
+        return Eigen::Product<LaplacianOperator, Rhs, Eigen::AliasFreeProduct>(*this, x.derived());
+    }
+};
+
+namespace Eigen
+{
+namespace internal
+{
+template <typename Solver, typename Rhs>
+struct generic_product_impl<LaplacianOperator<Solver>, Rhs, SparseShape, DenseShape, GemvProduct>
+    : generic_product_impl_base<LaplacianOperator<Solver>, Rhs, generic_product_impl<LaplacianOperator<Solver>, Rhs>>
+{
+    template <typename Dest>
+    static void scaleAndAddTo(Dest &dst, const LaplacianOperator<Solver> &lhs, const Rhs &rhs, const ::real &alpha)
+    {
+        lhs.solver->apply_laplacian(rhs, dst, alpha);
+    }
+};
+} // namespace internal
+} // namespace Eigen
+
+// Jacobi preconditioner of a LaplacianOperator, from the solver's diagonal;
+// zeros are replaced by ones as in Eigen::DiagonalPreconditioner.
+struct OperatorJacobi
+{
+    VecX inv_diag;
+
+    template <typename Op>
+    OperatorJacobi &analyzePattern(const Op &) { return *this; }
+    template <typename Op>
+    OperatorJacobi &factorize(const Op &op)
+    {
+        inv_diag = op.solver->laplacian_diag.unaryExpr([](real d) { return d != 0 ? 1 / d : 1; });
+        return *this;
+    }
+    template <typename Op>
+    OperatorJacobi &compute(const Op &op) { return factorize(op); }
+    VecX solve(const VecX &b) const { return inv_diag.cwiseProduct(b); }
+    Eigen::ComputationInfo info() const { return Eigen::Success; }
+};
+
+// Smoothed aggregation algebraic multigrid as a Krylov preconditioner: one
+// V-cycle with damped Jacobi smoothing per application. Strongly coupled
+// unknowns are grouped into aggregates, the piecewise constant prolongator
+// over them is smoothed by one Jacobi step, and coarse matrices are Galerkin
+// products. The hierarchy is reused for `reuse` factorizations, with only the
+// finest matrix replaced, since the particle couplings change slowly.
+class AMGPreconditioner
+{
+  public:
+    using Csr = Eigen::SparseMatrix<real, Eigen::RowMajor>;
+    int reuse = 4;        // factorize() calls served by one hierarchy
+    real strength = 0.25; // Strong coupling: |a_ij| >= strength * max_k!=i |a_ik|
+    int coarsest = 64;    // Size solved directly
+    int sweeps = 1;       // Jacobi sweeps before and after each coarse correction
+
+    template <typename M>
+    AMGPreconditioner &analyzePattern(const M &)
+    {
+        return *this;
+    }
+
+    template <typename M>
+    AMGPreconditioner &factorize(const M &a)
+    {
+        if (age < reuse && !levels.empty() && levels[0].A.rows() == a.rows())
         {
-            Vec2i nb = coord + nb_dirs[d];
-            if (!valid_cell(nb))
-                continue;
-            Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-            for (int p = 1; p <= bucket[0]; ++p)
+            set_level(levels[0], Csr(a));
+            ++age;
+        }
+        else
+            setup(a);
+        return *this;
+    }
+
+    template <typename M>
+    AMGPreconditioner &compute(const M &a)
+    {
+        return factorize(a);
+    }
+
+    void invalidate() { age = reuse; } // Unknowns renumbered: set up anew
+
+    VecX solve(const VecX &b) const { return cycle(0, b); }
+
+    Eigen::ComputationInfo info() const { return Eigen::Success; }
+
+    int num_levels() const { return static_cast<int>(levels.size()) + 1; }
+
+  private:
+    struct Level
+    {
+        Csr A, P, R;
+        VecX inv_diag; // 0 for a zero diagonal
+        real omega;    // Jacobi damping, 4 / 3 over a bound of rho(D^-1 A)
+    };
+    std::vector<Level> levels;
+    Eigen::PartialPivLU<Mat<Eigen::Dynamic>> coarse;
+    int age = 0;
+
+    static void set_level(Level &l, const Csr &a)
+    {
+        l.A = a;
+        l.inv_diag.resize(a.rows());
+        real rho = 0.0;
+        for (int i = 0; i < a.rows(); ++i)
+        {
+            real d = 0.0, row_sum = 0.0;
+            for (Csr::InnerIterator it(a, i); it; ++it)
             {
-                int j = bucket[p];
-                if (i == j)
-                    continue;
-                Vec2 dX = X[j] - X[i];
-                if (dX.norm() > re)
-                    continue;
-                real theta_ij = 180.0 / PI * (std::atan2(dX[1], dX[0]) + PI);
-                real dtheta_ij = 180.0 / PI * std::atan2(0.5 * l0, sqrt(dX.dot(dX) - 0.25 * l0 * l0));
-                int lowb = static_cast<int>(theta_ij - dtheta_ij) % N_screen;
-                int rangeb = static_cast<int>(2 * dtheta_ij);
-                for (int k = 0; k < rangeb; ++k){
-                    int idx = (lowb + k) % N_screen;
-                    if(idx < 0) idx += N_screen;
-                    screen[idx] = true;
+                if (it.col() == i)
+                    d = it.value();
+                row_sum += std::abs(it.value());
+            }
+            l.inv_diag[i] = d != 0 ? 1 / d : 0;
+            rho = std::max(rho, row_sum * std::abs(l.inv_diag[i]));
+        }
+        l.omega = 4.0 / 3.0 / std::max(rho, real(1));
+    }
+
+    // Greedy aggregation (Vanek et al.): a free unknown whose strong neighbors
+    // are all free takes them as its aggregate, leftovers join the aggregate
+    // they couple to most strongly or group among themselves. Unknowns without
+    // strong couplings stay out (-1) and are left to the smoother.
+    int aggregate(const Csr &a, std::vector<int> &agg) const
+    {
+        const int n = a.rows(), free = -2;
+        VecX max_off = VecX::Zero(n);
+        for (int i = 0; i < n; ++i)
+            for (Csr::InnerIterator it(a, i); it; ++it)
+                if (it.col() != i)
+                    max_off[i] = std::max(max_off[i], std::abs(it.value()));
+        auto strong = [&](int i, const Csr::InnerIterator &it) {
+            return it.col() != i && it.value() != 0 && std::abs(it.value()) >= strength * max_off[i];
+        };
+        agg.assign(n, -1);
+        for (int i = 0; i < n; ++i)
+            for (Csr::InnerIterator it(a, i); it; ++it)
+                if (strong(i, it))
+                    agg[i] = free;
+        int n_agg = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            if (agg[i] != free)
+                continue;
+            bool all_free = true;
+            for (Csr::InnerIterator it(a, i); it; ++it)
+                if (strong(i, it) && agg[it.col()] >= 0)
+                    all_free = false;
+            if (!all_free)
+                continue;
+            for (Csr::InnerIterator it(a, i); it; ++it)
+                if (strong(i, it))
+                    agg[it.col()] = n_agg;
+            agg[i] = n_agg++;
+        }
+        std::vector<int> roots = agg;
+        for (int i = 0; i < n; ++i)
+        {
+            if (agg[i] != free)
+                continue;
+            real best = 0.0;
+            for (Csr::InnerIterator it(a, i); it; ++it)
+                if (strong(i, it) && roots[it.col()] >= 0 && std::abs(it.value()) > best)
+                {
+                    best = std::abs(it.value());
+                    agg[i] = roots[it.col()];
                 }
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            if (agg[i] != free)
+                continue;
+            for (Csr::InnerIterator it(a, i); it; ++it)
+                if (strong(i, it) && agg[it.col()] == free)
+                    agg[it.col()] = n_agg;
+            agg[i] = n_agg++;
+        }
+        return n_agg;
+    }
+
+    template <typename M>
+    void setup(const M &matrix)
+    {
+        levels.clear();
+        age = 0;
+        Csr a = matrix;
+        std::vector<int> agg;
+        while (a.rows() > coarsest)
+        {
+            Level l;
+            set_level(l, a);
+            int n_agg = aggregate(a, agg);
+            std::vector<Eigen::Triplet<real>> t;
+            for (int i = 0; i < a.rows(); ++i)
+                if (agg[i] >= 0)
+                    t.emplace_back(i, agg[i], 1.0);
+            Csr T(a.rows(), n_agg);
+            T.setFromTriplets(t.begin(), t.end());
+            Csr smoothing = (l.omega * l.inv_diag).asDiagonal() * a;
+            Csr smoothed = smoothing * T;
+            l.P = T - smoothed;
+            l.R = l.P.transpose();
+            a = Csr(l.R * (a * l.P)).pruned();
+            levels.push_back(std::move(l));
+            if (n_agg == 0 || n_agg == levels.back().A.rows()) // No coarsening left
+                break;
+        }
+        if (a.rows() > 0)
+            coarse.compute(a.toDense());
+    }
+
+    VecX cycle(size_t k, const VecX &b) const
+    {
+        if (k == levels.size())
+            return b.size() > 0 ? VecX(coarse.solve(b)) : b;
+        const Level &l = levels[k];
+        VecX x = l.omega * l.inv_diag.cwiseProduct(b);
+        for (int s = 1; s < sweeps; ++s)
+            x += l.omega * l.inv_diag.cwiseProduct(b - l.A * x);
+        x += l.P * cycle(k + 1, l.R * (b - l.A * x));
+        for (int s = 0; s < sweeps; ++s)
+            x += l.omega * l.inv_diag.cwiseProduct(b - l.A * x);
+        return x;
+    }
+};
+
+// Per-step telemetry: the simulation thread push()es plain records into a
+// lock-free single-producer single-consumer ring, and never formats or
+// flushes. A drain thread writes them out as CSV through Record::write().
+// When the ring is full the record is dropped and counted instead of
+// stalling the step.
+template <typename Record>
+class Telemetry
+{
+  public:
+    explicit Telemetry(const std::string &path, size_t capacity = 1024) // "-": stdout
+        : ring(capacity + 1)
+    {
+        file = path == "-" ? stdout : std::fopen(path.c_str(), "w");
+        if (!file)
+        {
+            std::cerr << "cannot write " << path << std::endl;
+            return;
+        }
+        drain = std::thread([this] { run(); });
+    }
+
+    ~Telemetry() // Writes out what is left
+    {
+        done.store(true, std::memory_order_release);
+        if (drain.joinable())
+            drain.join();
+        if (file && file != stdout)
+            std::fclose(file);
+    }
+
+    void push(const Record &r)
+    {
+        size_t t = tail.load(std::memory_order_relaxed), next = (t + 1) % ring.size();
+        if (!file || next == head.load(std::memory_order_acquire))
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        ring[t] = r;
+        tail.store(next, std::memory_order_release);
+    }
+
+  private:
+    std::vector<Record> ring; // One slot stays empty to tell full from empty
+    std::atomic<size_t> head{0}, tail{0};
+    std::atomic<long long> dropped{0};
+    std::atomic<bool> done{false};
+    FILE *file;
+    std::thread drain;
+
+    void run()
+    {
+        std::fprintf(file, "%s\n", Record::header());
+        for (;;)
+        {
+            bool finished = done.load(std::memory_order_acquire); // Before draining: no record is missed
+            size_t h = head.load(std::memory_order_relaxed);
+            for (; h != tail.load(std::memory_order_acquire); h = (h + 1) % ring.size())
+            {
+                ring[h].write(file);
+                head.store((h + 1) % ring.size(), std::memory_order_release);
             }
+            std::fflush(file);
+            if (finished)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
         }
-        int n_block = 0;
-        for (int k = 0; k < N_screen; ++k)
+        if (dropped > 0)
+            std::fprintf(file, "# %lld records dropped\n", dropped.load());
+        std::fflush(file);
+    }
+};
+
+// The whole solver, sized at construction: Nx * Nx free particles, with the
+// wall and the cell grid scaled along (Nx = 40: 240 wall particles, 20 x 20
+// cells). Per-particle state is one runtime-sized aligned array per quantity.
+struct MPS
+{
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    // Resolution
+    const int Nx, N;  // free particles
+    const int Nw, Nb; // boundary particles
+    const int grid_res, n_cells;
+    const real dx, dx_inv;
+
+    //parameters
+    real l0 = sqrt(R * R / N);
+    real dt = 1e-2;
+    Vec2 grav{0, -1.0};
+    real re = 3.1 * l0;
+    real n0; //reference particle density
+    real lambda0;
+    real relax = 0.2; // PPE relaxation coefficient gamma (glibc declares ::gamma)
+    real rho = 1.0;
+    Vec2 bound_min = Vec2(0.05, 0.05), bound_max = Vec2(0.95, 0.95);
+
+    // Data
+    int current_frame = 0;
+    Array<Vec2> X, V;
+    std::vector<real> N_d;   //number density
+    std::vector<char> Label; // 0=free, 1=near wall boundary, 2=A, 3=B
+    // Cell list in CSR form, rebuilt by a counting sort: the particles of cell c
+    // are cell_particles[cell_begin[c] .. cell_begin[c + 1]), in index order.
+    std::vector<int> cell_begin, cell_particles;
+    // Scratch of build_cell_list(), kept per solver so that several can step at once
+    std::vector<int> chunk_count, particle_cell; // [cell][chunk], [particle]
+    Array<Vec2> old_vec2;                        // Copies permute() reads from
+    std::vector<char> old_char;
+    std::vector<int> old_int;
+    VecX old_real;
+    bool sort_particles = false; // Also reorder the particle arrays into cell order
+    std::vector<int> id;         // Seeding index of each particle
+    // Verlet neighbor list in CSR form: the particles within re + skin of particle
+    // i, i itself included, are pairs[pair_begin[i] .. pair_begin[i + 1]), in cell
+    // list order. Each pair caches rij = X[j] - X[i], its norm and Wa. The list is
+    // kept until some particle has moved more than skin / 2 since it was built;
+    // until then only the cached geometry is refreshed. re + skin must stay <= dx.
+    std::vector<int> pair_begin;
+    Array<Pair> pairs;
+    real skin = 0.0;   // 0: rebuild every step. Set through set_skin()
+    Array<Vec2> X_built; // X at the last build
+    int n_builds = 0;    // Number of list rebuilds so far
+    Array<Vec2> X_b, N_b;
+    // Row i of the Laplacian has one entry per pair of i, the self pair giving
+    // the diagonal, so its pattern only changes when the neighbor list is rebuilt.
+    // Pair p's value goes to Laplacian.valuePtr()[csr_slot[p]].
+    SpMat Laplacian;
+    std::vector<int> csr_slot;
+    int laplacian_builds = -1; // n_builds when the pattern was set up
+    Eigen::ConjugateGradient<SpMat, Eigen::Lower | Eigen::Upper> cg_jacobi;
+    Eigen::ConjugateGradient<SpMat, Eigen::Lower | Eigen::Upper, Eigen::IncompleteCholesky<real>> cg_ic;
+    Eigen::ConjugateGradient<SpMat, Eigen::Lower | Eigen::Upper, AMGPreconditioner> cg_amg;
+    int cg_jacobi_analyzed = -1, cg_ic_analyzed = -1, cg_amg_analyzed = -1; // laplacian_builds at the pattern analysis
+    PressureSolver pressure_solver = PressureSolver::CG_Jacobi;
+    real pressure_tolerance = Eigen::NumTraits<real>::epsilon(); // Relative residual
+    SolveStats pressure_stats = {}; // Of the last solve
+    long long total_iterations = 0; // Over all solves
+    // Matrix-free: the solvers apply the Laplacian straight from the pairs and
+    // only its diagonal is kept; CG_IC and CG_AMG fall back to Jacobi
+    // preconditioning.
+    bool matrix_free = false;
+    VecX laplacian_diag;
+    VecX rhs, Pdt;
+    // Telemetry: advance() fills step, and also pushes it to telemetry if set
+    StepRecord step = {};
+    Telemetry<StepRecord> *telemetry = nullptr;
+
+    explicit MPS(int Nx)
+        : Nx(Nx), N(Nx * Nx), Nw(3 * Nx / 2), Nb(4 * Nw), grid_res(std::max(Nx / 2, 1)),
+          n_cells(grid_res * grid_res), dx(1.0 / grid_res), dx_inv(grid_res)
+    {
+        X.resize(N);
+        V.resize(N);
+        N_d.resize(N);
+        Label.resize(N);
+        cell_begin.resize(n_cells + 1);
+        cell_particles.resize(N);
+        id.resize(N);
+        pair_begin.resize(N + 1);
+        X_built.resize(N);
+        X_b.resize(Nb);
+        N_b.resize(Nb);
+        rhs.setZero(N);
+        Pdt.setZero(N);
+        init();
+    }
+
+    real Wa(real r)
+    {
+        // real ret = 0.0;
+        // if (r < re)
+        //     ret = re / r - 1;
+        // return ret;
+        real ret = 0.0;
+        if (r < re)
+            ret = pow(1 - r / re, 2);
+        return ret;
+    };
+
+    bool valid_cell(const Vec2i &c)
+    {
+        return (c[0] >= 0) && (c[0] < grid_res) && (c[1] >= 0) && (c[1] < grid_res);
+    }
+
+    bool near_boundary(const Vec2 &r)
+    {
+        return (r[0] < bound_min[0] + re) || (r[0] > bound_max[0] - re) ||
+               (r[1] < bound_min[1] + re) || (r[1] > bound_max[1] - re);
+    }
+
+    // Bins hidden by a neighbor at dX: rangeb bins from lowb, truncated from the
+    // angles in degrees as the screen always did. The polynomial angles decide
+    // unless a truncation lies within their error of an integer or the direction
+    // is at the -180/180 degree seam; then atan2 does, so the labels are the same.
+    void screen_bins(const Vec2 &dX, int &lowb, int &rangeb)
+    {
+        const real deg = 180.0 / PI, margin = 2e-5; // Degrees, for two angles
+        real w2 = dX.dot(dX) - 0.25 * l0 * l0;
+        if (w2 < 0) // Closer than l0 / 2: the angles are NaN, nothing is hidden
+        {
+            rangeb = 0;
+            return;
+        }
+        real theta_ij = deg * (atan2_approx(dX[1], dX[0]) + PI);
+        real dtheta_ij = deg * atan2_approx(0.5 * l0, sqrt(w2));
+        auto stable = [&](real v) { return static_cast<int>(v - margin) == static_cast<int>(v + margin); };
+        if (!(theta_ij > margin && theta_ij < 360 - margin && stable(theta_ij - dtheta_ij) && stable(2 * dtheta_ij)))
+        {
+            theta_ij = deg * (std::atan2(dX[1], dX[0]) + PI);
+            dtheta_ij = deg * std::atan2(0.5 * l0, sqrt(w2));
+        }
+        lowb = static_cast<int>(theta_ij - dtheta_ij) % N_screen;
+        rangeb = static_cast<int>(2 * dtheta_ij);
+    }
+
+    Vec2i cell_coord(const Vec2 &r) // Outside the grid: the nearest border cell
+    {
+        Vec2i c = (r * dx_inv).cast<int>();
+        return c.cwiseMax(0).cwiseMin(grid_res - 1);
+    }
+
+    template <typename T>
+    void permute(T &a, T &old) // a[k] = a[cell_particles[k]], old is scratch
+    {
+        old = a;
+        taichi::parallel_for(0, N, [&](int k) { a[k] = old[cell_particles[k]]; });
+    }
+
+    // Counting sort by cell, in chunks of particles that count and scatter in
+    // parallel; chunk c writes behind chunks 0..c-1 in every cell, so the order
+    // within a cell stays the index order. No per-cell capacity limit.
+    void build_cell_list()
+    {
+        const int chunks = 64;
+        auto chunk = [&](int c) { return N * c / chunks; };
+        chunk_count.assign(n_cells * chunks, 0);
+        particle_cell.resize(N);
+        taichi::parallel_for(0, chunks, [&](int c) {
+            for (int i = chunk(c); i < chunk(c + 1); ++i)
+            {
+                Vec2i coord = cell_coord(X[i]);
+                particle_cell[i] = coord[0] * grid_res + coord[1];
+                ++chunk_count[particle_cell[i] * chunks + c];
+            }
+        }, 1);
+        for (int k = 0, sum = 0; k < n_cells * chunks; ++k) // Exclusive scan
         {
-            n_block += static_cast<int>(screen[k]);
+            if (k % chunks == 0)
+                cell_begin[k / chunks] = sum;
+            int c = chunk_count[k];
+            chunk_count[k] = sum;
+            sum += c;
         }
-        if (static_cast<double>(n_block) / N_screen < 5.0 / 6.0)
-            Label[i] = 2;
+        cell_begin[n_cells] = N;
+        taichi::parallel_for(0, chunks, [&](int c) {
+            for (int i = chunk(c); i < chunk(c + 1); ++i)
+                cell_particles[chunk_count[particle_cell[i] * chunks + c]++] = i;
+        }, 1);
+        if (!sort_particles)
+            return;
+        permute(X, old_vec2); // Neighbors in space become neighbors in memory
+        permute(V, old_vec2);
+        permute(Label, old_char);
+        permute(Pdt, old_real);
+        permute(id, old_int);
+        for (int k = 0; k < N; ++k)
+            cell_particles[k] = k;
+        cg_amg.preconditioner().invalidate(); // Its aggregates are in the old order
     }
-    for (int i = 0; i < N; ++i)
+
+    template <typename F>
+    void for_each_candidate(int i, const F &f) // Particles in the 9 cells around i
     {
-        if (Label[i] == 2)
-            continue;
-        real ni = 0.0;
-        bool has_A = false;
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
+        Vec2i coord = cell_coord(X[i]);
         for (int d = 0; d < 9; ++d)
         {
             Vec2i nb = coord + nb_dirs[d];
             if (!valid_cell(nb))
                 continue;
-            Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-            for (int p = 1; p <= bucket[0]; ++p)
+            int cell = nb[0] * grid_res + nb[1];
+            for (int k = cell_begin[cell]; k < cell_begin[cell + 1]; ++k)
+                f(cell_particles[k]);
+        }
+    }
+
+    void refresh_pairs()
+    {
+        taichi::parallel_for(0, N, [&](int i) {
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
+            {
+                Pair &pair = pairs[p];
+                pair.rij = X[pair.j] - X[i];
+                pair.r = pair.rij.norm();
+                pair.wa = Wa(pair.r);
+            }
+        });
+    }
+
+    // Clamped so that re + skin <= dx: the list only scans the 9 cells around i.
+    // Rebuilds the list, which may have been built with a smaller cutoff.
+    void set_skin(real value)
+    {
+        real old = skin;
+        skin = std::max(real(0), std::min(value, dx - re));
+        if (skin != value)
+            std::cerr << "skin " << value << " clamped to " << skin << " (re + skin <= dx)" << std::endl;
+        if (skin != old)
+            update_neighbors(true);
+    }
+
+    void update_neighbors(bool rebuild = false)
+    {
+        if (!rebuild && skin > 0)
+        {
+            real max_d2 = taichi::parallel_reduce(0, N, 0.0, [&](int i) { return (X[i] - X_built[i]).squaredNorm(); },
+                                                  [](real a, real b) { return std::max(a, b); });
+            rebuild = 4 * max_d2 > skin * skin;
+        }
+        if (!rebuild && skin > 0)
+        {
+            refresh_pairs();
+            return;
+        }
+        build_cell_list();
+        assert(re + skin <= dx); // Backstop for set_skin(): candidates come from 9 cells
+        const real cutoff = re + skin;
+        taichi::parallel_for(0, N, [&](int i) { // Count, scan, then fill
+            int count = 0;
+            for_each_candidate(i, [&](int j) { count += (X[j] - X[i]).norm() <= cutoff; });
+            pair_begin[i + 1] = count;
+        });
+        pair_begin[0] = 0;
+        for (int i = 0; i < N; ++i)
+            pair_begin[i + 1] += pair_begin[i];
+        pairs.resize(pair_begin[N]);
+        taichi::parallel_for(0, N, [&](int i) {
+            int p = pair_begin[i];
+            for_each_candidate(i, [&](int j) {
+                if ((X[j] - X[i]).norm() <= cutoff)
+                    pairs[p++].j = j;
+            });
+        });
+        X_built = X;
+        ++n_builds;
+        refresh_pairs();
+    }
+
+    void update_label()
+    {
+        std::fill(Label.begin(), Label.end(), 0);
+        taichi::parallel_for(0, N, [&](int i) {
+            AngularScreen screen;
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
             {
-                int j = bucket[p];
+                const Pair &pair = pairs[p];
+                int j = pair.j;
                 if (i == j)
                     continue;
-                Vec2 dX = X[j] - X[i];
-                if (dX.norm() > re)
+                if (pair.r > re)
                     continue;
-                ni += Wa(dX.norm());
+                int lowb, rangeb;
+                screen_bins(pair.rij, lowb, rangeb);
+                if (rangeb > 0)
+                    screen.set((lowb + N_screen) % N_screen, rangeb);
+            }
+            int n_block = screen.count();
+            if (static_cast<double>(n_block) / N_screen < 5.0 / 6.0)
+                Label[i] = 2;
+        });
+        for (int i = 0; i < N; ++i)
+        {
+            if (Label[i] == 2)
+                continue;
+            real ni = 0.0;
+            bool has_A = false;
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
+            {
+                const Pair &pair = pairs[p];
+                int j = pair.j;
+                if (i == j)
+                    continue;
+                if (pair.r > re)
+                    continue;
+                ni += pair.wa;
                 if (Label[j] == 2)
                     has_A = true;
             }
+            if (has_A && ni <= n0)
+                Label[i] = 3;
         }
-        if (has_A && ni <= n0)
-            Label[i] = 3;
     }
-}
 
-void compute_N_d()
-{
-    std::fill(N_d.begin(), N_d.end(), 0.0);
-    for (int i = 0; i < N; ++i)
+    void compute_N_d()
     {
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
-        for (int d = 0; d < 9; ++d)
-        {
-            Vec2i nb = coord + nb_dirs[d];
-            if (!valid_cell(nb))
-                continue;
-            Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-            for (int p = 1; p <= bucket[0]; ++p)
+        std::fill(N_d.begin(), N_d.end(), 0.0);
+        taichi::parallel_for(0, N, [&](int i) {
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
             {
-                int j = bucket[p];
+                const Pair &pair = pairs[p];
+                int j = pair.j;
                 if (i == j)
                     continue;
-                Vec2 dX = X[j] - X[i];
-                N_d[i] += Wa(dX.norm());
+                N_d[i] += pair.wa;
             }
-        }
+        });
     }
-}
 
-void solve_pressure()
-{
-    Laplacian.setZero();
-    Laplacian.resize(N, N);
-    rhs.setZero();
-    triplets.clear();
-    for (int i = 0; i < N; ++i)
-    {
-        real diag_coef = 0.0;
-        real n_star = 0.0;
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
-        for (int d = 0; d < 9; ++d)
-        {
-            Vec2i nb = coord + nb_dirs[d];
-            if (!valid_cell(nb))
-                continue;
-            Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-            for (int p = 1; p <= bucket[0]; ++p)
+    void build_laplacian_pattern() // Row offsets from pair_begin, columns sorted per row
+    {
+        Laplacian.resize(N, N);
+        Laplacian.resizeNonZeros(pair_begin[N]);
+        std::copy(pair_begin.begin(), pair_begin.end(), Laplacian.outerIndexPtr());
+        csr_slot.resize(pair_begin[N]);
+        int *inner = Laplacian.innerIndexPtr();
+        taichi::parallel_for(0, N, [&](int i) {
+            int *b = inner + pair_begin[i], *e = inner + pair_begin[i + 1];
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
+                inner[p] = pairs[p].j;
+            std::sort(b, e);
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
+                csr_slot[p] = std::lower_bound(b, e, pairs[p].j) - inner;
+        });
+        laplacian_builds = n_builds;
+    }
+
+    template <typename Vx, typename Vy>
+    void apply_laplacian(const Vx &x, Vy &y, real alpha) const // y += alpha * Laplacian * x
+    {
+        const real scale = 4 / lambda0 / n0;
+        taichi::parallel_for(0, N, [&](int i) {
+            real sum = laplacian_diag[i] * x.coeff(i);
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
             {
-                int j = bucket[p];
+                const Pair &pair = pairs[p];
+                if (pair.j != i)
+                    sum -= scale * pair.wa * x.coeff(pair.j);
+            }
+            y.coeffRef(i) += alpha * sum;
+        });
+    }
+
+    void solve_pressure()
+    {
+        if (matrix_free)
+            laplacian_diag.resize(N);
+        else if (laplacian_builds != n_builds)
+            build_laplacian_pattern();
+        real *value = Laplacian.valuePtr();
+        taichi::parallel_for(0, N, [&](int i) {
+            real diag_coef = 0.0;
+            real n_star = 0.0;
+            int diag = 0;
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
+            {
+                const Pair &pair = pairs[p];
+                int j = pair.j;
                 if (i == j)
+                {
+                    diag = p;
                     continue;
-                Vec2 dX = X[j] - X[i];
-                if (dX.norm() > re)
-                    continue;
-                real coef = 4 / lambda0 / n0 * Wa(dX.norm());
-                n_star += Wa(dX.norm());
-                triplets.push_back(Triplet(i, j, -coef));
+                }
+                real coef = 4 / lambda0 / n0 * pair.wa; // Wa vanishes beyond re
+                n_star += pair.wa;
+                if (!matrix_free)
+                    value[csr_slot[p]] = -coef;
                 diag_coef += coef;
             }
+            rhs[i] = relax * rho / dt * (n_star - std::min(N_d[i], n0)) / n0;
+            if ((Label[i] == 2) || (Label[i] == 3))
+            {
+                diag_coef += 4 / lambda0 / n0 * std::max(n0 - n_star, 0.0);
+            }
+            if (matrix_free)
+                laplacian_diag[i] = diag_coef;
+            else
+                value[csr_slot[diag]] = diag_coef;
+        });
+        auto cg = [&](auto &solver, int &analyzed) { // Preconditioner pattern analysis only on a new pattern
+            if (analyzed != laplacian_builds)
+                solver.analyzePattern(Laplacian);
+            analyzed = laplacian_builds;
+            solver.setTolerance(pressure_tolerance);
+            solver.factorize(Laplacian);
+            Pdt = solver.solveWithGuess(rhs, Pdt);
+            pressure_stats = {static_cast<int>(solver.iterations()), solver.error()};
+        };
+        LaplacianOperator<MPS> op{};
+        op.solver = this;
+        if (matrix_free && pressure_solver == PressureSolver::GMRES)
+        {
+            Eigen::GMRES<LaplacianOperator<MPS>, OperatorJacobi> solver(op);
+            solver.setTolerance(pressure_tolerance);
+            Pdt = solver.solve(rhs);
+            pressure_stats = {static_cast<int>(solver.iterations()), solver.error()};
         }
-        rhs[i] = gamma * rho / dt * (n_star - std::min(N_d[i], n0)) / n0;
-        if ((Label[i] == 2) || (Label[i] == 3))
+        else if (matrix_free)
         {
-            diag_coef += 4 / lambda0 / n0 * std::max(n0 - n_star, 0.0);
+            Eigen::ConjugateGradient<LaplacianOperator<MPS>, Eigen::Lower | Eigen::Upper, OperatorJacobi> solver(op);
+            solver.setTolerance(pressure_tolerance);
+            Pdt = solver.solveWithGuess(rhs, Pdt);
+            pressure_stats = {static_cast<int>(solver.iterations()), solver.error()};
         }
-        triplets.push_back(Triplet(i, i, diag_coef));
+        else if (pressure_solver == PressureSolver::CG_Jacobi)
+            cg(cg_jacobi, cg_jacobi_analyzed);
+        else if (pressure_solver == PressureSolver::CG_IC)
+            cg(cg_ic, cg_ic_analyzed);
+        else if (pressure_solver == PressureSolver::CG_AMG)
+            cg(cg_amg, cg_amg_analyzed);
+        else
+        {
+            Eigen::GMRES<SpMat> solver(Laplacian);
+            solver.setTolerance(pressure_tolerance);
+            Pdt = solver.solve(rhs);
+            pressure_stats = {static_cast<int>(solver.iterations()), solver.error()};
+        }
+        total_iterations += pressure_stats.iterations;
     }
-    Laplacian.setFromTriplets(triplets.begin(), triplets.end());
-    Eigen::GMRES<SpMat> solver(Laplacian);
-    Pdt = solver.solve(rhs);
-    std::cout << "[iters: " << solver.iterations() << " error: " << solver.error() << "]" << std::endl;
-}
 
-void pre_update()
-{
-    for (int i = 0; i < N; ++i)
+    void pre_update()
     {
-        V[i] += dt * 1e-1 * (Vec2(0.5, 0.5) - X[i]);
-        X[i] += dt * V[i];
+        taichi::parallel_for(0, N, [&](int i) {
+            V[i] += dt * 1e-1 * (Vec2(0.5, 0.5) - X[i]);
+            X[i] += dt * V[i];
+        });
     }
-}
 
-void post_update()
-{
-    for (int i = 0; i < N; ++i)
+    void post_update() // Moves X in place, so distances are taken afresh
     {
-        Vec2 grad_pdt = Vec2::Zero();
-        Vec2i coord = (X[i] * dx_inv).cast<int>();
-        real minp = std::min(Pdt[i], 0.0);
-        for (int d = 0; d < 9; ++d)
+        for (int i = 0; i < N; ++i)
         {
-            Vec2i nb = coord + nb_dirs[d];
-            if (!valid_cell(nb))
-                continue;
-            Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-            for (int p = 1; p <= bucket[0]; ++p)
+            Vec2 grad_pdt = Vec2::Zero();
+            real minp = std::min(Pdt[i], 0.0);
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
             {
-                int j = bucket[p];
+                const Pair &pair = pairs[p];
+                int j = pair.j;
                 if (i == j)
                     continue;
                 if ((X[j] - X[i]).norm() <= re)
                     minp = std::min(minp, Pdt[j]);
             }
-        }
-        for (int d = 0; d < 9; ++d)
-        {
-            Vec2i nb = coord + nb_dirs[d];
-            if (!valid_cell(nb))
-                continue;
-            Bucket &bucket = hashing[nb[0] * grid_res + nb[1]];
-            for (int p = 1; p <= bucket[0]; ++p)
+            for (int p = pair_begin[i]; p < pair_begin[i + 1]; ++p)
             {
-                int j = bucket[p];
+                const Pair &pair = pairs[p];
+                int j = pair.j;
                 if (i == j)
                     continue;
                 Vec2 dX = X[j] - X[i];
                 grad_pdt += 2 / n0 * (Pdt[j] - minp) / dX.dot(dX) * dX * Wa(dX.norm());
             }
+            V[i] -= 1 / rho * grad_pdt;
+            X[i] -= dt / rho * grad_pdt;
         }
-        V[i] -= 1 / rho * grad_pdt;
-        X[i] -= dt / rho * grad_pdt;
     }
-}
 
-void advance()
-{
-    pre_update();
-    update_label();
-    compute_N_d();
-    solve_pressure();
-    post_update();
-}
+    void advance()
+    {
+        double t = taichi::Time::get_time();
+        int phase = 0;
+        auto lap = [&] { // The time since the last lap goes to the next phase
+            double now = taichi::Time::get_time();
+            step.phase_time[phase++] = now - t;
+            t = now;
+        };
+        pre_update();
+        lap();
+        update_neighbors();
+        lap();
+        update_label();
+        lap();
+        compute_N_d();
+        lap();
+        solve_pressure();
+        lap();
+        post_update();
+        lap();
+        record_step();
+    }
 
-void init()
-{
-    //free particles
-    std::fill(V.begin(), V.end(), Vec2::Zero());
-    real tdx = R / Nx;
-    n0 = 0.0;
-    lambda0 = 0.0;
-    Vec2 ref_X = Vec2(0.5 - R / 2 + tdx * (Nx / 2), 0.5 - R / 2 + tdx * (Nx / 2));
-    for (int i = 0; i < Nx; ++i)
-    {
-        for (int j = 0; j < Nx; ++j)
-        {
-            X[i * Nx + j] = Vec2(0.5 - R / 2 + tdx * i, 0.5 - R / 2 + tdx * j);
-            if ((i != Nx / 2) || (j != Nx / 2))
-                n0 += Wa((X[i * Nx + j] - ref_X).norm());
-        }
+    void record_step()
+    {
+        step.frame = current_frame;
+        step.pressure = pressure_stats;
+        step.pairs = pair_begin[N];
+        std::fill(std::begin(step.labels), std::end(step.labels), 0);
+        for (char l : Label)
+            ++step.labels[static_cast<int>(l)];
+        if (telemetry)
+            telemetry->push(step);
     }
-    for (int i = 0; i < Nx; ++i)
+
+    void init()
     {
-        for (int j = 0; j < Nx; ++j)
+        //free particles
+        std::fill(V.begin(), V.end(), Vec2::Zero());
+        for (int i = 0; i < N; ++i)
+            id[i] = i;
+        real tdx = R / Nx;
+        n0 = 0.0;
+        lambda0 = 0.0;
+        Vec2 ref_X = Vec2(0.5 - R / 2 + tdx * (Nx / 2), 0.5 - R / 2 + tdx * (Nx / 2));
+        for (int i = 0; i < Nx; ++i)
         {
-            X[i * Nx + j] = Vec2(0.5 - R / 2 + tdx * i, 0.5 - R / 2 + tdx * j);
-            if ((i != Nx / 2) || (j != Nx / 2))
+            for (int j = 0; j < Nx; ++j)
             {
-                Vec2 dX = X[i * Nx + j] - ref_X;
-                lambda0 += dX.dot(dX) * Wa(dX.norm());
+                X[i * Nx + j] = Vec2(0.5 - R / 2 + tdx * i, 0.5 - R / 2 + tdx * j);
+                if ((i != Nx / 2) || (j != Nx / 2))
+                    n0 += Wa((X[i * Nx + j] - ref_X).norm());
             }
         }
-    }
-    lambda0 /= n0;
+        for (int i = 0; i < Nx; ++i)
+        {
+            for (int j = 0; j < Nx; ++j)
+            {
+                X[i * Nx + j] = Vec2(0.5 - R / 2 + tdx * i, 0.5 - R / 2 + tdx * j);
+                if ((i != Nx / 2) || (j != Nx / 2))
+                {
+                    Vec2 dX = X[i * Nx + j] - ref_X;
+                    lambda0 += dX.dot(dX) * Wa(dX.norm());
+                }
+            }
+        }
+        lambda0 /= n0;
 
-    //wall boundary
-    real tdw = (bound_max[0] - bound_min[0]) / Nw;
-    Vec2 norms[4] = {Vec2(0.0, 1.0), Vec2(-1.0, 0.0), Vec2(0.0, -1.0), Vec2(1.0, 0.0)};
-    Vec2 dirs[4] = {Vec2(1.0, 0.0), Vec2(0.0, 1.0), Vec2(-1.0, 0.0), Vec2(0.0, -1.0)};
-    Vec2 offsets[4] = {Vec2(bound_min[0] + tdw / 2, bound_min[1]), Vec2(bound_max[0], bound_min[1] + tdw / 2),
-                       Vec2(bound_max[0] - tdw / 2, bound_max[1]), Vec2(bound_min[0], bound_max[1] - tdw / 2)};
-    for (int i = 0; i < Nw; ++i)
-    {
-        for (int j = 0; j < 4; ++j)
+        //wall boundary
+        real tdw = (bound_max[0] - bound_min[0]) / Nw;
+        Vec2 norms[4] = {Vec2(0.0, 1.0), Vec2(-1.0, 0.0), Vec2(0.0, -1.0), Vec2(1.0, 0.0)};
+        Vec2 dirs[4] = {Vec2(1.0, 0.0), Vec2(0.0, 1.0), Vec2(-1.0, 0.0), Vec2(0.0, -1.0)};
+        Vec2 offsets[4] = {Vec2(bound_min[0] + tdw / 2, bound_min[1]), Vec2(bound_max[0], bound_min[1] + tdw / 2),
+                           Vec2(bound_max[0] - tdw / 2, bound_max[1]), Vec2(bound_min[0], bound_max[1] - tdw / 2)};
+        for (int i = 0; i < Nw; ++i)
         {
-            N_b[j * Nw + i] = norms[j];
-            X_b[j * Nw + i] = offsets[j] + i * tdw * dirs[j];
+            for (int j = 0; j < 4; ++j)
+            {
+                N_b[j * Nw + i] = norms[j];
+                X_b[j * Nw + i] = offsets[j] + i * tdw * dirs[j];
+            }
         }
+        update_neighbors(true);
+        update_label();
+    }
+
+    // Checkpoint <base>.tcb: {next frame, N, X, V, Label, Pdt, id}, one bulk copy
+    // per array. Written to a temporary file first, so a crash while writing
+    // keeps the previous checkpoint. Returns false if a checkpoint being read
+    // has another N or is shorter than N calls for.
+    template <bool writing>
+    bool serialize(taichi::BinarySerializer<writing> &s, int &frame)
+    {
+        int n = N;
+        if (!writing && s.head + 2 * sizeof(int) > s.preserved)
+            return false;
+        s(frame);
+        s(n);
+        std::size_t bytes = s.head + std::size_t(N) * (2 * sizeof(Vec2) + sizeof(char) + sizeof(real) + sizeof(int));
+        if (n != N || (!writing && bytes > s.preserved)) // Checked before any bulk read
+            return false;
+        s.bulk(X.data(), N);
+        s.bulk(V.data(), N);
+        s.bulk(Label.data(), N);
+        s.bulk(Pdt.data(), N);
+        s.bulk(id.data(), N);
+        return true;
+    }
+};
+
+// Command line options, which may come anywhere among the positional
+// arguments: --matrix-free applies the pressure Laplacian without assembling
+// it, --amg preconditions CG with algebraic multigrid, --skin <s> keeps the
+// neighbor list until a particle has moved s / 2 (clamped to re + s <= dx),
+// --sort reorders the particle arrays into cell order at every list rebuild,
+// --telemetry <path> writes per-step metrics as CSV ("-": stdout).
+struct Options
+{
+    bool matrix_free = false, amg = false, sort = false;
+    real skin = 0;
+    std::string telemetry;
+};
+
+std::vector<std::string> parse_args(int argc, char *argv[], Options &options)
+{
+    std::vector<std::string> args;
+    for (int k = 1; k < argc; ++k)
+    {
+        std::string arg = argv[k];
+        if (arg == "--matrix-free")
+            options.matrix_free = true;
+        else if (arg == "--amg")
+            options.amg = true;
+        else if (arg == "--sort")
+            options.sort = true;
+        else if (arg == "--skin" && k + 1 < argc)
+            options.skin = std::stod(argv[++k]);
+        else if (arg == "--telemetry" && k + 1 < argc)
+            options.telemetry = argv[++k];
+        else
+            args.push_back(arg);
     }
-    reset_hashing();
-    update_label();
+    return args;
 }
 
-int main()
+#if defined(TC_HEADLESS)
+// Batch mode: a fixed number of frames as fast as possible, each frame's
+// state written to <prefix>NNNNN.bin as {int N; Vec2 X[N], V[N]; char Label[N]}
+void dump_frame(const MPS &mps, const std::string &path)
 {
-    init();
+    FILE *f = std::fopen(path.c_str(), "wb");
+    if (!f)
+    {
+        std::cerr << "cannot write " << path << std::endl;
+        return;
+    }
+    int n = mps.N;
+    Array<Vec2> x(n), v(n); // In seeding order
+    std::vector<char> label(n);
+    for (int i = 0; i < n; ++i)
+    {
+        x[mps.id[i]] = mps.X[i];
+        v[mps.id[i]] = mps.V[i];
+        label[mps.id[i]] = mps.Label[i];
+    }
+    std::fwrite(&n, sizeof(n), 1, f);
+    std::fwrite(x.data(), sizeof(Vec2), n, f);
+    std::fwrite(v.data(), sizeof(Vec2), n, f);
+    std::fwrite(label.data(), sizeof(char), n, f);
+    std::fclose(f);
+}
+
+void save_checkpoint(MPS &mps, const std::string &base, int frame)
+{
+    taichi::BinaryOutputSerializer s;
+    s.initialize();
+    mps.serialize(s, frame);
+    s.finalize();
+    s.write_to_file(base + ".tmp.tcb");
+    std::rename((base + ".tmp.tcb").c_str(), (base + ".tcb").c_str());
+}
+
+int load_checkpoint(MPS &mps, const std::string &base) // returns the next frame
+{
+    if (!std::ifstream(base + ".tcb"))
+        return 0;
+    taichi::BinaryInputSerializer s;
+    s.initialize(base + ".tcb");
+    int frame = 0;
+    if (!mps.serialize(s, frame))
+    {
+        std::cerr << base << ".tcb: other N, or truncated, starting over" << std::endl;
+        return 0;
+    }
+    s.finalize();
+    mps.update_neighbors(true); // The list built by init() is stale
+    return frame;
+}
+
+// [frames] [output prefix] [checkpoint every K frames] [particles per side]
+int main(int argc, char *argv[])
+{
+    Options options;
+    auto args = parse_args(argc, argv, options);
+    int frames = args.size() > 0 ? std::stoi(args[0]) : 100;
+    std::string prefix = args.size() > 1 ? args[1] : "frame_";
+    int checkpoint_interval = args.size() > 2 ? std::stoi(args[2]) : 0;
+    MPS mps(args.size() > 3 ? std::stoi(args[3]) : 40);
+    mps.matrix_free = options.matrix_free;
+    mps.sort_particles = options.sort;
+    mps.set_skin(options.skin);
+    if (options.amg)
+        mps.pressure_solver = PressureSolver::CG_AMG;
+    std::unique_ptr<Telemetry<StepRecord>> telemetry;
+    if (!options.telemetry.empty())
+    {
+        telemetry.reset(new Telemetry<StepRecord>(options.telemetry));
+        mps.telemetry = telemetry.get();
+    }
+    int first = checkpoint_interval > 0 ? load_checkpoint(mps, prefix + "checkpoint") : 0;
+    auto start = taichi::Time::get_time();
+    for (mps.current_frame = first; mps.current_frame < frames; ++mps.current_frame)
+    {
+        int frame = mps.current_frame;
+        mps.advance();
+        dump_frame(mps, prefix + fmt::format("{:05d}.bin", frame));
+        if (checkpoint_interval > 0 && (frame + 1) % checkpoint_interval == 0)
+            save_checkpoint(mps, prefix + "checkpoint", frame + 1);
+    }
+    real t = taichi::Time::get_time() - start;
+    std::cout << frames - first << " frames, " << frames - first << " steps in " << t << " s: "
+              << (frames - first) / t << " steps/s, " << mps.total_iterations << " pressure iterations" << std::endl;
+    return 0;
+}
+#else
+int main(int argc, char *argv[]) // [particles per side]
+{
+    Options options;
+    auto args = parse_args(argc, argv, options);
+    MPS mps(args.size() > 0 ? std::stoi(args[0]) : 40);
+    mps.matrix_free = options.matrix_free;
+    mps.sort_particles = options.sort;
+    mps.set_skin(options.skin);
+    if (options.amg)
+        mps.pressure_solver = PressureSolver::CG_AMG;
+    Telemetry<StepRecord> telemetry(options.telemetry.empty() ? "-" : options.telemetry);
+    mps.telemetry = &telemetry;
     taichi::GUI gui("LSMPS", window_size, window_size);
     auto &canvas = gui.get_canvas();
-    for (current_frame = 0;; ++current_frame)
+    for (;; ++mps.current_frame)
     {
-        advance();
+        mps.advance();
         canvas.clear(0x112F41);
         //canvas.rect(taichi::Vector2(0.04), taichi::Vector2(0.96)).radius(2).color(0x4FB99F).close();
-        for (int i = 0; i < N; ++i)
-            canvas.circle(X[i][0], X[i][1]).radius(2).color(colors[Label[i]]);
-        for (int i = 0; i < Nb; ++i)
-            canvas.circle(X_b[i][0], X_b[i][1]).radius(2).color(0x99CDCD);
+        for (int i = 0; i < mps.N; ++i)
+            canvas.circle(mps.X[i][0], mps.X[i][1]).radius(2).color(colors[mps.Label[i]]);
+        for (int i = 0; i < mps.Nb; ++i)
+            canvas.circle(mps.X_b[i][0], mps.X_b[i][1]).radius(2).color(0x99CDCD);
         gui.update();
     }
 }
+#endif
@@ -2,7 +2,10 @@
 // DO NOT EDIT BY HAND, unless you know that you are doing.
 #define TC_INCLUDED
 #define TC_AMALGAMATED
+#if !defined(TC_ISE_SSE) && !defined(TC_ISE_AVX) && !defined(TC_ISE_AVX2) && \
+    !defined(TC_ISE_AVX512)
 #define TC_ISE_NONE
+#endif
 /*******************************************************************************
     copyright (c) the taichi authors (2016- ). all rights reserved.
     the use of this software is governed by the license file.
@@ -5133,9 +5136,23 @@ extern Logger logger;
 
 namespace zip {
 
+#if defined(TC_AMALGAMATED)
+// The single header ships without miniz: .tcb.zip files are not supported
+inline void write(std::string fn, const uint8 *data, std::size_t len) {
+  TC_ERROR("Cannot write {}: no zip support in the amalgamated header", fn);
+}
+inline void write(const std::string &fn, const std::string &data) {
+  TC_ERROR("Cannot write {}: no zip support in the amalgamated header", fn);
+}
+inline std::vector<uint8> read(const std::string fn, bool verbose = false) {
+  TC_ERROR("Cannot read {}: no zip support in the amalgamated header", fn);
+  return std::vector<uint8>();
+}
+#else
 void write(std::string fn, const uint8 *data, std::size_t len);
 void write(const std::string &fn, const std::string &data);
 std::vector<uint8> read(const std::string fn, bool verbose = false);
+#endif
 
 }  // namespace zip
 
@@ -5373,19 +5390,14 @@ inline std::vector<uint8> read_data_from_file(const std::string &fn) {
     // Read zip file, e.g. particles.tcb.zip
     return zip::read(fn);
   } else {
-    // Read uncompressed file, e.g. particles.tcb
+    // Read uncompressed file, e.g. particles.tcb, in one call
     assert(f != nullptr);
-    std::size_t length = 0;
-    while (true) {
-      size_t limit = 1 << 8;
-      data.resize(data.size() + limit);
-      void *ptr = reinterpret_cast<void *>(&data[length]);
-      size_t length_tmp = fread(ptr, sizeof(uint8_t), limit, f);
-      length += length_tmp;
-      if (length_tmp < limit) {
-        break;
-      }
-    }
+    std::fseek(f, 0, SEEK_END);
+    long size = std::ftell(f);
+    std::fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? std::size_t(size) : 0);
+    std::size_t length =
+        data.empty() ? 0 : fread(&data[0], sizeof(uint8_t), data.size(), f);
     std::fclose(f);
     data.resize(length);
     return data;
@@ -5418,7 +5430,7 @@ class BinarySerializer : public Serializer {
   uint8_t *c_data;
 
   std::size_t head;
-  std::size_t preserved;
+  std::size_t preserved;  // Writing: capacity of c_data. Reading: bytes loaded
 
   using Base = Serializer;
   using Base::assets;
@@ -5427,6 +5439,11 @@ class BinarySerializer : public Serializer {
   typename std::enable_if<!writing_, void>::type initialize(
       const std::string &fn) {
     data = read_data_from_file(fn);
+    preserved = data.size();  // Reading: the loaded size bounds every read
+    if (preserved < sizeof(std::size_t)) {  // Then any read is past preserved
+      TC_WARN("File {} (size {}) is too short.", fn, preserved);
+      data.resize(sizeof(std::size_t));
+    }
     c_data = reinterpret_cast<uint8_t *>(&data[0]);
     head = sizeof(std::size_t);
   }
@@ -5473,7 +5490,9 @@ class BinarySerializer : public Serializer {
       c_data = reinterpret_cast<uint8_t *>(raw_data);
     }
     head = sizeof(std::size_t);
-    preserved = 0;
+    // The size finalize() stored, if the caller did not give it
+    preserved = preserved_ != 0 ? preserved_
+                                : *reinterpret_cast<std::size_t *>(c_data);
   }
 
   void finalize() {
@@ -5548,6 +5567,9 @@ class BinarySerializer : public Serializer {
         std::memcpy(&data[head], &val, sizeof(T));
       }
     } else {
+      if (head + sizeof(T) > preserved) {
+        TC_CRITICAL("Loaded Buffer (size {}) Overflow.", preserved);
+      }
       // get_writable(val) =
       //    *reinterpret_cast<typename std::remove_reference<T>::type *>(
       //        &c_data[head]);
@@ -5563,6 +5585,34 @@ class BinarySerializer : public Serializer {
     val.io(*this);
   }
 
+  // n bitwise-copyable elements in one memcpy, e.g. the data of a
+  // std::vector<float> or a std::array of fixed-size vectors
+  template <typename T>
+  void bulk(const T *val, std::size_t n) {
+    static_assert(!std::is_pointer<T>::value, "T cannot be pointer");
+    std::size_t size = sizeof(T) * n, new_size = head + size;
+    if (size == 0) {
+      return;
+    }
+    if (writing) {
+      if (c_data) {
+        if (new_size > preserved) {
+          TC_CRITICAL("Preserved Buffer (size {}) Overflow.", preserved);
+        }
+        std::memcpy(&c_data[head], val, size);
+      } else {
+        data.resize(new_size);
+        std::memcpy(&data[head], val, size);
+      }
+    } else {
+      if (new_size > preserved) {
+        TC_CRITICAL("Loaded Buffer (size {}) Overflow.", preserved);
+      }
+      std::memcpy(const_cast<T *>(val), &c_data[head], size);
+    }
+    head = new_size;
+  }
+
   // Unique Pointers to non-taichi-unit Types
   template <typename T>
   typename std::enable_if<!type::is_unit<T>::value, void>::type operator()(
@@ -5645,8 +5695,8 @@ class BinarySerializer : public Serializer {
   }
 
   // std::vector
-  template <typename T>
-  void operator()(const char *, const std::vector<T> &val_) {
+  template <typename T, typename A>
+  void operator()(const char *, const std::vector<T, A> &val_) {
     auto &val = get_writable(val_);
     if (writing) {
       this->operator()("", val.size());
@@ -5655,13 +5705,19 @@ class BinarySerializer : public Serializer {
       this->operator()("", n);
       val.resize(n);
     }
-    /*
-    for (std::size_t i = 0; i < val.size(); i++) {
-      printf("i %d\n", i);
-      printf("val %d\n", val[i]);
-    }
+    // Numbers: same layout as element by element, in one copy
+    using numbers = std::integral_constant<
+        bool, std::is_arithmetic<T>::value && !std::is_same<T, bool>::value>;
+    vector_elements(val, numbers());
+  }
 
-     */
+  template <typename T, typename A>
+  void vector_elements(std::vector<T, A> &val, std::true_type) {
+    bulk(val.data(), val.size());
+  }
+
+  template <typename T, typename A>
+  void vector_elements(std::vector<T, A> &val, std::false_type) {
     for (std::size_t i = 0; i < val.size(); i++) {
       this->operator()("", val[i]);
     }
@@ -6606,21 +6662,138 @@ TC_NAMESPACE_BEGIN
 
 // Instruction Set Extension
 
-enum class InstSetExt { None, SSE, AVX, AVX2 };
+enum class InstSetExt { None, SSE, AVX, AVX2, AVX512 };
 
+// Selected at build time with -DTC_ISE_<SSE|AVX|AVX2|AVX512>; the compiler
+// must target the chosen extension too (-mavx2 -mfma, -march=skylake-avx512).
 #ifdef TC_ISE_NONE
 constexpr InstSetExt default_instruction_set = InstSetExt::None;
-#elif TC_ISE_SSE
+#elif defined(TC_ISE_SSE)
 constexpr InstSetExt default_instruction_set = InstSetExt::SSE;
-#elif TC_ISE_AVX
+#elif defined(TC_ISE_AVX)
+#if !defined(__AVX__)
+#error "TC_ISE_AVX needs a compiler target with AVX (-mavx)"
+#endif
 constexpr InstSetExt default_instruction_set = InstSetExt::AVX;
-#elif TC_ISE_AVX2
+#elif defined(TC_ISE_AVX2)
+#if !defined(__AVX2__) || !defined(__FMA__)
+#error "TC_ISE_AVX2 needs a compiler target with AVX2 and FMA (-mavx2 -mfma)"
+#endif
 constexpr InstSetExt default_instruction_set = InstSetExt::AVX2;
+#elif defined(TC_ISE_AVX512)
+#if !defined(__AVX512F__) || !defined(__AVX2__) || !defined(__FMA__)
+#error "TC_ISE_AVX512 needs a compiler target with AVX-512F (-march=skylake-avx512)"
+#endif
+constexpr InstSetExt default_instruction_set = InstSetExt::AVX512;
 #else
 #define TC_ISE_ISE_NONE
 constexpr InstSetExt default_instruction_set = InstSetExt::None;
 #endif
 
+// The widest extension the CPU running the program supports.
+inline InstSetExt cpu_instruction_set() {
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("fma"))
+    return InstSetExt::AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return InstSetExt::AVX2;
+  if (__builtin_cpu_supports("avx"))
+    return InstSetExt::AVX;
+  if (__builtin_cpu_supports("sse4.1"))
+    return InstSetExt::SSE;
+  return InstSetExt::None;
+#else
+  return default_instruction_set;  // No detection: trust the build
+#endif
+}
+
+// A binary built for a wider extension than the CPU has would stop with
+// SIGILL somewhere in the first vector operation; check at startup instead.
+struct InstructionSetCheck {
+  InstructionSetCheck() {
+    static const char *names[] = {"none", "SSE", "AVX", "AVX2", "AVX-512"};
+    InstSetExt cpu = cpu_instruction_set();
+    if (cpu < default_instruction_set) {
+      std::fprintf(stderr, "built for %s, but this CPU only supports %s\n",
+                   names[(int)default_instruction_set], names[(int)cpu]);
+      std::exit(1);
+    }
+  }
+};
+static InstructionSetCheck instruction_set_check;
+
+// Lane-wise arithmetic on the registers of the wider VectorND storages. FMA
+// falls back to a multiply and an add when the target has none.
+TC_FORCE_INLINE __m128 simd_fmadd(__m128 a, __m128 b, __m128 c) {
+#if defined(__FMA__)
+  return _mm_fmadd_ps(a, b, c);
+#else
+  return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+
+#if defined(__AVX__)
+TC_FORCE_INLINE __m256d simd_add(__m256d a, __m256d b) {
+  return _mm256_add_pd(a, b);
+}
+TC_FORCE_INLINE __m256d simd_sub(__m256d a, __m256d b) {
+  return _mm256_sub_pd(a, b);
+}
+TC_FORCE_INLINE __m256d simd_mul(__m256d a, __m256d b) {
+  return _mm256_mul_pd(a, b);
+}
+TC_FORCE_INLINE __m256d simd_div(__m256d a, __m256d b) {
+  return _mm256_div_pd(a, b);
+}
+TC_FORCE_INLINE __m256d simd_fmadd(__m256d a, __m256d b, __m256d c) {
+#if defined(__FMA__)
+  return _mm256_fmadd_pd(a, b, c);
+#else
+  return _mm256_add_pd(_mm256_mul_pd(a, b), c);
+#endif
+}
+TC_FORCE_INLINE __m256 simd_add(__m256 a, __m256 b) {
+  return _mm256_add_ps(a, b);
+}
+TC_FORCE_INLINE __m256 simd_sub(__m256 a, __m256 b) {
+  return _mm256_sub_ps(a, b);
+}
+TC_FORCE_INLINE __m256 simd_mul(__m256 a, __m256 b) {
+  return _mm256_mul_ps(a, b);
+}
+TC_FORCE_INLINE __m256 simd_div(__m256 a, __m256 b) {
+  return _mm256_div_ps(a, b);
+}
+TC_FORCE_INLINE __m256 simd_fmadd(__m256 a, __m256 b, __m256 c) {
+#if defined(__FMA__)
+  return _mm256_fmadd_ps(a, b, c);
+#else
+  return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+#endif
+
+#if defined(__AVX512F__)
+TC_FORCE_INLINE __m512d simd_add(__m512d a, __m512d b) {
+  return _mm512_add_pd(a, b);
+}
+TC_FORCE_INLINE __m512d simd_sub(__m512d a, __m512d b) {
+  return _mm512_sub_pd(a, b);
+}
+TC_FORCE_INLINE __m512d simd_mul(__m512d a, __m512d b) {
+  return _mm512_mul_pd(a, b);
+}
+TC_FORCE_INLINE __m512d simd_div(__m512d a, __m512d b) {
+  return _mm512_div_pd(a, b);
+}
+TC_FORCE_INLINE __m512d simd_fmadd(__m512d a, __m512d b, __m512d c) {
+  return _mm512_fmadd_pd(a, b, c);
+}
+#endif
+
 /////////////////////////////////////////////////////////////////
 /////              N dimensional Vector
 /////////////////////////////////////////////////////////////////
@@ -6702,7 +6875,9 @@ struct VectorNDBase<
     T,
     ISE,
     typename std::enable_if_t<(!std::is_same<T, float32>::value ||
-                               ISE < InstSetExt::SSE)>> {
+                               ISE < InstSetExt::SSE) &&
+                              (!std::is_same<T, float64>::value ||
+                               ISE < InstSetExt::AVX)>> {
   static constexpr int storage_elements = 4;
   static constexpr bool simd = false;
   union {
@@ -6733,6 +6908,63 @@ struct TC_ALIGNED(16)
   }
 };
 
+template <InstSetExt ISE>
+struct TC_ALIGNED(32)
+    VectorNDBase<4, float64, ISE, std::enable_if_t<(ISE >= InstSetExt::AVX)>> {
+  static constexpr bool simd = true;
+  static constexpr int storage_elements = 4;
+  union {
+    __m256d v;
+    struct {
+      float64 x, y, z, w;
+    };
+    float64 d[4];
+  };
+
+  TC_FORCE_INLINE VectorNDBase(float64 x = 0.0) : v(_mm256_set1_pd(x)) {
+  }
+
+  TC_FORCE_INLINE explicit VectorNDBase(__m256d v) : v(v) {
+  }
+};
+
+template <InstSetExt ISE>
+struct TC_ALIGNED(32)
+    VectorNDBase<8, float32, ISE, std::enable_if_t<(ISE >= InstSetExt::AVX)>> {
+  static constexpr bool simd = true;
+  static constexpr int storage_elements = 8;
+  union {
+    __m256 v;
+    float32 d[8];
+  };
+
+  TC_FORCE_INLINE VectorNDBase(float32 x = 0.0_f) : v(_mm256_set1_ps(x)) {
+  }
+
+  TC_FORCE_INLINE explicit VectorNDBase(__m256 v) : v(v) {
+  }
+};
+
+template <InstSetExt ISE>
+struct TC_ALIGNED(64)
+    VectorNDBase<8,
+                 float64,
+                 ISE,
+                 std::enable_if_t<(ISE >= InstSetExt::AVX512)>> {
+  static constexpr bool simd = true;
+  static constexpr int storage_elements = 8;
+  union {
+    __m512d v;
+    float64 d[8];
+  };
+
+  TC_FORCE_INLINE VectorNDBase(float64 x = 0.0) : v(_mm512_set1_pd(x)) {
+  }
+
+  TC_FORCE_INLINE explicit VectorNDBase(__m512d v) : v(v) {
+  }
+};
+
 template <int dim__, typename T, InstSetExt ISE = default_instruction_set>
 struct VectorND : public VectorNDBase<dim__, T, ISE> {
   static constexpr int dim = dim__;
@@ -6746,6 +6978,31 @@ struct VectorND : public VectorNDBase<dim__, T, ISE> {
   template <int dim_, typename T_, InstSetExt ISE_>
   static constexpr bool SIMD_NONE = !SIMD_4_32F<dim_, T_, ISE_>;
 
+  // Wider storages: Vector4d in an __m256d and 8 floats in an __m256 from AVX
+  // on, 8 doubles in an __m512d with AVX-512. They keep the d[] layout, so
+  // only the arithmetic below differs from the scalar path. Vector3d stays
+  // scalar: padding it to 32 bytes costs more grid bandwidth than it saves.
+  // MatrixND of these dims holds such columns and adds an FMA matrix-vector
+  // product and, for Matrix4d, an in-register transpose.
+  template <int dim_, typename T_, InstSetExt ISE_>
+  static constexpr bool SIMD_4_64F = dim_ == 4 &&
+                                     std::is_same<T_, float64>::value &&
+                                     ISE_ >= InstSetExt::AVX;
+
+  template <int dim_, typename T_, InstSetExt ISE_>
+  static constexpr bool SIMD_8_32F =
+      dim_ == 8 && std::is_same<T_, float32>::value && ISE_ >= InstSetExt::AVX;
+
+  template <int dim_, typename T_, InstSetExt ISE_>
+  static constexpr bool SIMD_8_64F = dim_ == 8 &&
+                                     std::is_same<T_, float64>::value &&
+                                     ISE_ >= InstSetExt::AVX512;
+
+  template <int dim_, typename T_, InstSetExt ISE_>
+  static constexpr bool SIMD_WIDE = SIMD_4_64F<dim_, T_, ISE_> ||
+                                    SIMD_8_32F<dim_, T_, ISE_> ||
+                                    SIMD_8_64F<dim_, T_, ISE_>;
+
   static constexpr InstSetExt ise = ISE;
   using type = T;
 
@@ -6851,13 +7108,22 @@ struct VectorND : public VectorNDBase<dim__, T, ISE> {
   template <int dim_ = dim,
             typename T_ = T,
             InstSetExt ISE_ = ISE,
-            typename std::enable_if_t<SIMD_NONE<dim_, T_, ISE_>, int> = 0>
+            typename std::enable_if_t<SIMD_NONE<dim_, T_, ISE_> &&
+                                          !SIMD_WIDE<dim_, T_, ISE_>,
+                                      int> = 0>
   explicit TC_FORCE_INLINE VectorND(T v) {
     for (int i = 0; i < dim; i++) {
       this->d[i] = v;
     }
   }
 
+  template <int dim_ = dim,
+            typename T_ = T,
+            InstSetExt ISE_ = ISE,
+            typename std::enable_if_t<SIMD_WIDE<dim_, T_, ISE_>, int> = 0>
+  explicit TC_FORCE_INLINE VectorND(T v) : VectorNDBase<dim, T, ISE>(v) {
+  }
+
   explicit TC_FORCE_INLINE VectorND(T v0, T v1) {
     static_assert(dim == 2, "Vector dim must be 2");
     this->d[0] = v0;
@@ -6952,7 +7218,12 @@ struct VectorND : public VectorNDBase<dim__, T, ISE> {
   }
 
   TC_FORCE_INLINE VectorND &operator=(const VectorND &o) {
-    memcpy(this, &o, sizeof(*this));
+    if (std::is_arithmetic<T>::value) {
+      memcpy(this, &o, sizeof(*this));
+    } else {  // E.g. packets, copied register by register
+      for (int i = 0; i < dim; i++)
+        this->d[i] = o.d[i];
+    }
     return *this;
   }
 
@@ -6998,11 +7269,46 @@ struct VectorND : public VectorNDBase<dim__, T, ISE> {
     return VectorND(_mm_div_ps(this->v, o.v));
   }
 
+  // SIMD: Vector4d & 8-wide
+  template <int dim_ = dim,
+            typename T_ = T,
+            InstSetExt ISE_ = ISE,
+            typename std::enable_if_t<SIMD_WIDE<dim_, T_, ISE_>, int> = 0>
+  TC_FORCE_INLINE VectorND operator+(const VectorND &o) const {
+    return VectorND(simd_add(this->v, o.v));
+  }
+
+  template <int dim_ = dim,
+            typename T_ = T,
+            InstSetExt ISE_ = ISE,
+            typename std::enable_if_t<SIMD_WIDE<dim_, T_, ISE_>, int> = 0>
+  TC_FORCE_INLINE VectorND operator-(const VectorND &o) const {
+    return VectorND(simd_sub(this->v, o.v));
+  }
+
+  template <int dim_ = dim,
+            typename T_ = T,
+            InstSetExt ISE_ = ISE,
+            typename std::enable_if_t<SIMD_WIDE<dim_, T_, ISE_>, int> = 0>
+  TC_FORCE_INLINE VectorND operator*(const VectorND &o) const {
+    return VectorND(simd_mul(this->v, o.v));
+  }
+
+  template <int dim_ = dim,
+            typename T_ = T,
+            InstSetExt ISE_ = ISE,
+            typename std::enable_if_t<SIMD_WIDE<dim_, T_, ISE_>, int> = 0>
+  TC_FORCE_INLINE VectorND operator/(const VectorND &o) const {
+    return VectorND(simd_div(this->v, o.v));
+  }
+
   // Non-SIMD cases
   template <int dim_ = dim,
             typename T_ = T,
             InstSetExt ISE_ = ISE,
-            typename std::enable_if_t<SIMD_NONE<dim_, T_, ISE_>, int> = 0>
+            typename std::enable_if_t<SIMD_NONE<dim_, T_, ISE_> &&
+                                          !SIMD_WIDE<dim_, T_, ISE_>,
+                                      int> = 0>
   TC_FORCE_INLINE VectorND operator+(const VectorND &o) const {
     return VectorND([=](int i) { return this->d[i] + o[i]; });
   }
@@ -7010,7 +7316,9 @@ struct VectorND : public VectorNDBase<dim__, T, ISE> {
   template <int dim_ = dim,
             typename T_ = T,
             InstSetExt ISE_ = ISE,
-            typename std::enable_if_t<SIMD_NONE<dim_, T_, ISE_>, int> = 0>
+            typename std::enable_if_t<SIMD_NONE<dim_, T_, ISE_> &&
+                                          !SIMD_WIDE<dim_, T_, ISE_>,
+                                      int> = 0>
   TC_FORCE_INLINE VectorND operator-(const VectorND &o) const {
     return VectorND([=](int i) { return this->d[i] - o[i]; });
   }
@@ -7018,7 +7326,9 @@ struct VectorND : public VectorNDBase<dim__, T, ISE> {
   template <int dim_ = dim,
             typename T_ = T,
             InstSetExt ISE_ = ISE,
-            typename std::enable_if_t<SIMD_NONE<dim_, T_, ISE_>, int> = 0>
+            typename std::enable_if_t<SIMD_NONE<dim_, T_, ISE_> &&
+                                          !SIMD_WIDE<dim_, T_, ISE_>,
+                                      int> = 0>
   TC_FORCE_INLINE VectorND operator*(const VectorND &o) const {
     return VectorND([=](int i) { return this->d[i] * o[i]; });
   }
@@ -7026,7 +7336,9 @@ struct VectorND : public VectorNDBase<dim__, T, ISE> {
   template <int dim_ = dim,
             typename T_ = T,
             InstSetExt ISE_ = ISE,
-            typename std::enable_if_t<SIMD_NONE<dim_, T_, ISE_>, int> = 0>
+            typename std::enable_if_t<SIMD_NONE<dim_, T_, ISE_> &&
+                                          !SIMD_WIDE<dim_, T_, ISE_>,
+                                      int> = 0>
   TC_FORCE_INLINE VectorND operator/(const VectorND &o) const {
     return VectorND([=](int i) { return this->d[i] / o[i]; });
   }
@@ -7226,6 +7538,30 @@ struct VectorND : public VectorNDBase<dim__, T, ISE> {
     this->v = v;
   }
 
+  template <int dim_ = dim,
+            typename T_ = T,
+            InstSetExt ISE_ = ISE,
+            typename std::enable_if_t<SIMD_4_64F<dim_, T_, ISE_>, int> = 0>
+  TC_FORCE_INLINE explicit VectorND(__m256d v) {
+    this->v = v;
+  }
+
+  template <int dim_ = dim,
+            typename T_ = T,
+            InstSetExt ISE_ = ISE,
+            typename std::enable_if_t<SIMD_8_32F<dim_, T_, ISE_>, int> = 0>
+  TC_FORCE_INLINE explicit VectorND(__m256 v) {
+    this->v = v;
+  }
+
+  template <int dim_ = dim,
+            typename T_ = T,
+            InstSetExt ISE_ = ISE,
+            typename std::enable_if_t<SIMD_8_64F<dim_, T_, ISE_>, int> = 0>
+  TC_FORCE_INLINE explicit VectorND(__m512d v) {
+    this->v = v;
+  }
+
   template <int dim_ = dim,
             typename T_ = T,
             InstSetExt ISE_ = ISE,
@@ -7450,14 +7786,14 @@ using Vector4i = VectorND<4, int, default_instruction_set>;
 // FMA: a * b + c
 template <typename T>
 TC_FORCE_INLINE typename std::
-    enable_if<T::simd && (default_instruction_set >= InstSetExt::AVX), T>::type
+    enable_if<T::simd && (T::ise >= InstSetExt::AVX), T>::type
     fused_mul_add(const T &a, const T &b, const T &c) {
-  return T(_mm_fmadd_ps(a, b, c));
+  return T(simd_fmadd(a.v, b.v, c.v));
 }
 
 template <typename T>
 TC_FORCE_INLINE typename std::
-    enable_if<!T::simd || (default_instruction_set < InstSetExt::AVX), T>::type
+    enable_if<!T::simd || (T::ise < InstSetExt::AVX), T>::type
     fused_mul_add(const T &a, const T &b, const T &c) {
   return a * b + c;
 }
@@ -7479,6 +7815,13 @@ struct MatrixND {
 
   template <int dim_, typename T_, InstSetExt ISE_>
   static constexpr bool SIMD_NONE = !SIMD_4_32F<dim_, T_, ISE_>;
+
+  // Columns in __m256d / __m256 / __m512d (see VectorND): Matrix4d, and 8x8
+  // float / double matrices
+  template <int dim_, typename T_, InstSetExt ISE_>
+  static constexpr bool SIMD_WIDE =
+      VectorND<dim_, T_, ISE_>::template SIMD_WIDE<dim_, T_, ISE_>;
+
   using Vector = VectorND<dim, T, ISE>;
   Vector d[dim];
 
@@ -7587,7 +7930,9 @@ struct MatrixND {
   template <int dim_ = dim,
             typename T_ = T,
             InstSetExt ISE_ = ISE,
-            typename std::enable_if_t<!SIMD_4_32F<dim_, T_, ISE_>, int> = 0>
+            typename std::enable_if_t<!SIMD_4_32F<dim_, T_, ISE_> &&
+                                          !SIMD_WIDE<dim_, T_, ISE_>,
+                                      int> = 0>
   TC_FORCE_INLINE VectorND<dim, T, ISE> operator*(
       const VectorND<dim, T, ISE> &o) const {
     VectorND<dim, T, ISE> ret = d[0] * o[0];
@@ -7596,6 +7941,18 @@ struct MatrixND {
     return ret;
   }
 
+  // Matrix4d, 8x8: one broadcast and FMA per column
+  template <int dim_ = dim,
+            typename T_ = T,
+            InstSetExt ISE_ = ISE,
+            typename std::enable_if_t<SIMD_WIDE<dim_, T_, ISE_>, int> = 0>
+  TC_FORCE_INLINE Vector operator*(const Vector &o) const {
+    Vector ret = d[0] * Vector(o[0]);
+    for (int i = 1; i < dim; i++)
+      ret = fused_mul_add(d[i], Vector(o[i]), ret);
+    return ret;
+  }
+
   // Matrix3
   template <int dim_ = dim,
             typename T_ = T,
@@ -7637,7 +7994,12 @@ struct MatrixND {
   }
 
   TC_FORCE_INLINE MatrixND operator*(const MatrixND &o) const {
-    return MatrixND([&](int i) { return (*this) * o[i]; });
+    // A loop, not a lambda: GCC does not always inline the latter, which for
+    // matrices of packets sends every column through memory
+    MatrixND ret;
+    for (int i = 0; i < dim; i++)
+      ret[i] = (*this) * o[i];
+    return ret;
   }
 
   TC_FORCE_INLINE static MatrixND outer_product(Vector column, Vector row) {
@@ -7692,7 +8054,31 @@ struct MatrixND {
     return std::sqrt(frobenius_norm2());
   }
 
+#if defined(__AVX__)
+  // Matrix4d
+  template <int dim_ = dim,
+            typename T_ = T,
+            InstSetExt ISE_ = ISE,
+            typename std::enable_if_t<SIMD_WIDE<dim_, T_, ISE_> && dim_ == 4,
+                                      int> = 0>
+  TC_FORCE_INLINE MatrixND transposed() const {
+    __m256d t0 = _mm256_unpacklo_pd(d[0].v, d[1].v);  // 00 10 02 12
+    __m256d t1 = _mm256_unpackhi_pd(d[0].v, d[1].v);  // 01 11 03 13
+    __m256d t2 = _mm256_unpacklo_pd(d[2].v, d[3].v);  // 20 30 22 32
+    __m256d t3 = _mm256_unpackhi_pd(d[2].v, d[3].v);  // 21 31 23 33
+    return MatrixND(Vector(_mm256_permute2f128_pd(t0, t2, 0x20)),
+                    Vector(_mm256_permute2f128_pd(t1, t3, 0x20)),
+                    Vector(_mm256_permute2f128_pd(t0, t2, 0x31)),
+                    Vector(_mm256_permute2f128_pd(t1, t3, 0x31)));
+  }
+#endif
+
   // Matrix4
+  template <int dim_ = dim,
+            typename T_ = T,
+            InstSetExt ISE_ = ISE,
+            typename std::enable_if_t<!(SIMD_WIDE<dim_, T_, ISE_> && dim_ == 4),
+                                      int> = 0>
   TC_FORCE_INLINE MatrixND transposed() const {
     MatrixND ret;
     // TC_STATIC_IF((SIMD_4_32F<dim, T, ISE> && dim == 4)) {
@@ -7847,7 +8233,7 @@ using Matrix3d = MatrixND<3, float64, default_instruction_set>;
 using Matrix4d = MatrixND<4, float64, default_instruction_set>;
 
 template <typename T, InstSetExt ISE>
-TC_FORCE_INLINE real determinant(const MatrixND<2, T, ISE> &mat) {
+TC_FORCE_INLINE T determinant(const MatrixND<2, T, ISE> &mat) {
   return mat[0][0] * mat[1][1] - mat[0][1] * mat[1][0];
 }
 
@@ -8372,10 +8758,13 @@ TC_FORCE_INLINE __m128 broadcast(const __m128 &s) {
 }
 
 #if defined(TC_AMALGAMATED)
-TC_FORCE_INLINE void polar_decomp(Matrix2 m, Matrix2 &R, Matrix2 &S) {
+template <typename T, InstSetExt ISE>
+TC_FORCE_INLINE void polar_decomp(MatrixND<2, T, ISE> m,
+                                  MatrixND<2, T, ISE> &R,
+                                  MatrixND<2, T, ISE> &S) {
   auto x = m(0, 0) + m(1, 1);
   auto y = m(1, 0) - m(0, 1);
-  auto scale = 1.0_f / std::sqrt(x * x + y * y);
+  auto scale = T(1) / std::sqrt(x * x + y * y);
   auto c = x * scale, s = y * scale;
   R(0, 0) = c;
   R(0, 1) = -s;
@@ -8386,19 +8775,23 @@ TC_FORCE_INLINE void polar_decomp(Matrix2 m, Matrix2 &R, Matrix2 &S) {
 
 // Based on http://www.seas.upenn.edu/~cffjiang/research/svd/svd.pdf
 // Algorithm 4
-inline void svd(Matrix2 m, Matrix2 &U, Matrix2 &sig, Matrix2 &V) {
-  Matrix2 S;
+template <typename T, InstSetExt ISE>
+inline void svd(MatrixND<2, T, ISE> m,
+                MatrixND<2, T, ISE> &U,
+                MatrixND<2, T, ISE> &sig,
+                MatrixND<2, T, ISE> &V) {
+  MatrixND<2, T, ISE> S;
   polar_decomp(m, U, S);
-  real c, s;
-  if (std::abs(S(0, 1)) < 1e-6_f) {
+  T c, s;
+  if (std::abs(S(0, 1)) < T(1e-6)) {
     sig = S;
     c = 1;
     s = 0;
   } else {
-    auto tao = 0.5_f * (S(0, 0) - S(1, 1));
+    auto tao = T(0.5) * (S(0, 0) - S(1, 1));
     auto w = std::sqrt(tao * tao + S(0, 1) * S(0, 1));
     auto t = tao > 0 ? S(0, 1) / (tao + w) : S(0, 1) / (tao - w);
-    c = 1.0_f / std::sqrt(t * t + 1);
+    c = T(1) / std::sqrt(t * t + 1);
     s = -t * c;
     sig(0, 0) = pow<2>(c) * S(0, 0) - 2 * c * s * S(0, 1) + pow<2>(s) * S(1, 1);
     sig(1, 1) = pow<2>(s) * S(0, 0) + 2 * c * s * S(0, 1) + pow<2>(c) * S(1, 1);
@@ -8419,6 +8812,660 @@ inline void svd(Matrix2 m, Matrix2 &U, Matrix2 &sig, Matrix2 &V) {
   U = U * V;
 }
 
+// 3x3 SVD with a fixed number of Jacobi sweeps and branch-free Givens
+// rotations, after McAdams et al., "Computing the Singular Value
+// Decomposition of 3x3 matrices with minimal branching and elementary
+// floating point operations" (2011):
+//   1. Jacobi eigenanalysis of m^T m with approximate Givens angles -> V
+//   2. Sort the columns of B = m V by norm (swap + negate keeps det(V) = 1)
+//   3. QR-factorize B with Givens rotations -> U, R = sig
+// Like the 2x2 version, U and V are rotations and sig(2, 2) carries the sign
+// of det(m); sig(0, 0) >= sig(1, 1) >= |sig(2, 2)|. The paper uses 4 sweeps
+// for float; 5 keeps near-identity inputs (deformation gradients) at ~1e-6.
+template <typename T, InstSetExt ISE>
+inline void svd(const MatrixND<3, T, ISE> &m,
+                MatrixND<3, T, ISE> &U,
+                MatrixND<3, T, ISE> &sig,
+                MatrixND<3, T, ISE> &V,
+                int sweeps = std::is_same<T, float32>::value ? 5 : 8) {
+  const T gamma = T(5.828427124746190), cstar = T(0.923879532511287),
+          sstar = T(0.382683432365090), eps = std::numeric_limits<T>::epsilon();
+  T s[3][3], b[3][3], u[3][3], v[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+  // Post-multiply columns p, q of a by the rotation [c -s; s c]
+  auto rotate_columns = [](T a[3][3], int p, int q, T c, T s) {
+    for (int r = 0; r < 3; r++) {
+      T ap = a[r][p], aq = a[r][q];
+      a[r][p] = c * ap + s * aq;
+      a[r][q] = c * aq - s * ap;
+    }
+  };
+  auto rotate_rows = [](T a[3][3], int p, int q, T c, T s) {
+    for (int k = 0; k < 3; k++) {
+      T ap = a[p][k], aq = a[q][k];
+      a[p][k] = c * ap + s * aq;
+      a[q][k] = c * aq - s * ap;
+    }
+  };
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++) {
+      s[i][j] = 0;
+      for (int k = 0; k < 3; k++)
+        s[i][j] += m(k, i) * m(k, j);
+    }
+  const int pairs[3][2] = {{0, 1}, {0, 2}, {1, 2}};
+  for (int sweep = 0; sweep < sweeps; sweep++) {
+    for (auto &pq : pairs) {
+      int p = pq[0], q = pq[1];
+      // Approximate half angle; falls back to pi/8 when it would exceed it
+      T ch = 2 * (s[p][p] - s[q][q]), sh = s[p][q];
+      bool exact = gamma * sh * sh < ch * ch;
+      T w = T(1) / std::sqrt(ch * ch + sh * sh);
+      ch = exact ? w * ch : cstar;
+      sh = exact ? w * sh : sstar;
+      T c = ch * ch - sh * sh, sn = 2 * sh * ch;
+      rotate_columns(s, p, q, c, sn);
+      rotate_rows(s, p, q, c, sn);
+      rotate_columns(v, p, q, c, sn);
+    }
+  }
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++) {
+      b[i][j] = 0;
+      for (int k = 0; k < 3; k++)
+        b[i][j] += m(i, k) * v[k][j];
+    }
+  auto norm2 = [&](int j) {
+    return b[0][j] * b[0][j] + b[1][j] * b[1][j] + b[2][j] * b[2][j];
+  };
+  auto swap_columns = [&](int p, int q) {
+    bool swap = norm2(p) < norm2(q);
+    for (int r = 0; r < 3; r++) {
+      T bp = b[r][p], vp = v[r][p];
+      b[r][p] = swap ? b[r][q] : bp;
+      b[r][q] = swap ? -bp : b[r][q];
+      v[r][p] = swap ? v[r][q] : vp;
+      v[r][q] = swap ? -vp : v[r][q];
+    }
+  };
+  swap_columns(0, 1);
+  swap_columns(0, 2);
+  swap_columns(1, 2);
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++)
+      u[i][j] = T(i == j);
+  for (auto &pq : pairs) {
+    int p = pq[0], q = pq[1], col = pq[0];
+    T a1 = b[p][col], a2 = b[q][col];
+    T rho = std::sqrt(a1 * a1 + a2 * a2);
+    T sh = rho > eps ? a2 : T(0), ch = std::abs(a1) + std::max(rho, eps);
+    if (a1 < 0)
+      std::swap(ch, sh);
+    T w = T(1) / std::sqrt(ch * ch + sh * sh);
+    ch *= w;
+    sh *= w;
+    T c = ch * ch - sh * sh, sn = 2 * sh * ch;
+    rotate_rows(b, p, q, c, sn);
+    rotate_columns(u, p, q, c, sn);
+  }
+  sig = MatrixND<3, T, ISE>(T(0));
+  for (int i = 0; i < 3; i++) {
+    sig(i, i) = b[i][i];
+    for (int j = 0; j < 3; j++) {
+      U(i, j) = u[i][j];
+      V(i, j) = v[i][j];
+    }
+  }
+}
+
+template <typename T, InstSetExt ISE>
+inline void polar_decomp(const MatrixND<3, T, ISE> &m,
+                         MatrixND<3, T, ISE> &R,
+                         MatrixND<3, T, ISE> &S) {
+  MatrixND<3, T, ISE> U, sig, V;
+  svd(m, U, sig, V);
+  R = U * transposed(V);
+  S = V * sig * transposed(V);
+}
+
+// Lane-packed batches for cross-problem SIMD. A Packet<T, N> holds the same
+// scalar of N independent problems (e.g. 8 particles) in one register, so
+// VectorPacket / MatrixPacket, i.e. VectorND / MatrixND of packets, keep each
+// component in its own register (SoA). The usual operators, determinant(),
+// polar_decomp() and svd() then run N problems per instruction with the
+// source shape of the scalar code; branches become per-lane select().
+//
+// PacketOps<T, N> maps a packet to a register: __m256 (8 x float32) and
+// __m256d (4 x float64) with AVX, __m512d (8 x float64) with AVX-512, and a
+// plain array with lane loops otherwise. Comparisons return a lane mask, only
+// meant for select(), mask_or() and mask_bits().
+
+template <typename T, int N>
+struct PacketLanes {
+  T d[N];
+};
+
+template <typename T, int N>
+struct PacketOps {
+  using Register = PacketLanes<T, N>;
+  static TC_FORCE_INLINE Register set1(T a) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = a;
+    return r;
+  }
+  static TC_FORCE_INLINE Register add(Register a, Register b) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = a.d[i] + b.d[i];
+    return r;
+  }
+  static TC_FORCE_INLINE Register sub(Register a, Register b) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = a.d[i] - b.d[i];
+    return r;
+  }
+  static TC_FORCE_INLINE Register mul(Register a, Register b) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = a.d[i] * b.d[i];
+    return r;
+  }
+  static TC_FORCE_INLINE Register div(Register a, Register b) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = a.d[i] / b.d[i];
+    return r;
+  }
+  static TC_FORCE_INLINE Register fmadd(Register a, Register b, Register c) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = a.d[i] * b.d[i] + c.d[i];
+    return r;
+  }
+  static TC_FORCE_INLINE Register sqrt(Register a) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = std::sqrt(a.d[i]);
+    return r;
+  }
+  static TC_FORCE_INLINE Register floor(Register a) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = std::floor(a.d[i]);
+    return r;
+  }
+  static TC_FORCE_INLINE Register min(Register a, Register b) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = std::min(a.d[i], b.d[i]);
+    return r;
+  }
+  static TC_FORCE_INLINE Register max(Register a, Register b) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = std::max(a.d[i], b.d[i]);
+    return r;
+  }
+  static TC_FORCE_INLINE Register abs(Register a) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = std::abs(a.d[i]);
+    return r;
+  }
+  static TC_FORCE_INLINE Register neg(Register a) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = -a.d[i];
+    return r;
+  }
+  static TC_FORCE_INLINE Register less(Register a, Register b) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = T(a.d[i] < b.d[i]);
+    return r;
+  }
+  static TC_FORCE_INLINE Register mask_or(Register a, Register b) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = T(a.d[i] != T(0) || b.d[i] != T(0));
+    return r;
+  }
+  static TC_FORCE_INLINE Register select(Register mask, Register a, Register b) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = mask.d[i] != T(0) ? a.d[i] : b.d[i];
+    return r;
+  }
+  static TC_FORCE_INLINE int mask_bits(Register mask) {
+    int r = 0;
+    for (int i = 0; i < N; i++)
+      r |= int(mask.d[i] != T(0)) << i;
+    return r;
+  }
+  static TC_FORCE_INLINE Register load(const T *p) {
+    Register r;
+    for (int i = 0; i < N; i++)
+      r.d[i] = p[i];
+    return r;
+  }
+  static TC_FORCE_INLINE void store(T *p, Register a) {
+    for (int i = 0; i < N; i++)
+      p[i] = a.d[i];
+  }
+};
+
+#if defined(__AVX__)
+template <>
+struct PacketOps<float32, 8> {
+  using Register = __m256;
+  static TC_FORCE_INLINE Register set1(float32 a) {
+    return _mm256_set1_ps(a);
+  }
+  static TC_FORCE_INLINE Register add(Register a, Register b) {
+    return simd_add(a, b);
+  }
+  static TC_FORCE_INLINE Register sub(Register a, Register b) {
+    return simd_sub(a, b);
+  }
+  static TC_FORCE_INLINE Register mul(Register a, Register b) {
+    return simd_mul(a, b);
+  }
+  static TC_FORCE_INLINE Register div(Register a, Register b) {
+    return simd_div(a, b);
+  }
+  static TC_FORCE_INLINE Register fmadd(Register a, Register b, Register c) {
+    return simd_fmadd(a, b, c);
+  }
+  static TC_FORCE_INLINE Register sqrt(Register a) {
+    return _mm256_sqrt_ps(a);
+  }
+  static TC_FORCE_INLINE Register floor(Register a) {
+    return _mm256_floor_ps(a);
+  }
+  static TC_FORCE_INLINE Register min(Register a, Register b) {
+    return _mm256_min_ps(a, b);
+  }
+  static TC_FORCE_INLINE Register max(Register a, Register b) {
+    return _mm256_max_ps(a, b);
+  }
+  static TC_FORCE_INLINE Register abs(Register a) {
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+  }
+  static TC_FORCE_INLINE Register neg(Register a) {
+    return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f));
+  }
+  static TC_FORCE_INLINE Register less(Register a, Register b) {
+    return _mm256_cmp_ps(a, b, _CMP_LT_OQ);
+  }
+  static TC_FORCE_INLINE Register mask_or(Register a, Register b) {
+    return _mm256_or_ps(a, b);
+  }
+  static TC_FORCE_INLINE Register select(Register mask,
+                                         Register a,
+                                         Register b) {
+    return _mm256_blendv_ps(b, a, mask);
+  }
+  static TC_FORCE_INLINE int mask_bits(Register mask) {
+    return _mm256_movemask_ps(mask);
+  }
+  static TC_FORCE_INLINE Register load(const float32 *p) {
+    return _mm256_loadu_ps(p);
+  }
+  static TC_FORCE_INLINE void store(float32 *p, Register a) {
+    _mm256_storeu_ps(p, a);
+  }
+};
+
+template <>
+struct PacketOps<float64, 4> {
+  using Register = __m256d;
+  static TC_FORCE_INLINE Register set1(float64 a) {
+    return _mm256_set1_pd(a);
+  }
+  static TC_FORCE_INLINE Register add(Register a, Register b) {
+    return simd_add(a, b);
+  }
+  static TC_FORCE_INLINE Register sub(Register a, Register b) {
+    return simd_sub(a, b);
+  }
+  static TC_FORCE_INLINE Register mul(Register a, Register b) {
+    return simd_mul(a, b);
+  }
+  static TC_FORCE_INLINE Register div(Register a, Register b) {
+    return simd_div(a, b);
+  }
+  static TC_FORCE_INLINE Register fmadd(Register a, Register b, Register c) {
+    return simd_fmadd(a, b, c);
+  }
+  static TC_FORCE_INLINE Register sqrt(Register a) {
+    return _mm256_sqrt_pd(a);
+  }
+  static TC_FORCE_INLINE Register floor(Register a) {
+    return _mm256_floor_pd(a);
+  }
+  static TC_FORCE_INLINE Register min(Register a, Register b) {
+    return _mm256_min_pd(a, b);
+  }
+  static TC_FORCE_INLINE Register max(Register a, Register b) {
+    return _mm256_max_pd(a, b);
+  }
+  static TC_FORCE_INLINE Register abs(Register a) {
+    return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a);
+  }
+  static TC_FORCE_INLINE Register neg(Register a) {
+    return _mm256_xor_pd(a, _mm256_set1_pd(-0.0));
+  }
+  static TC_FORCE_INLINE Register less(Register a, Register b) {
+    return _mm256_cmp_pd(a, b, _CMP_LT_OQ);
+  }
+  static TC_FORCE_INLINE Register mask_or(Register a, Register b) {
+    return _mm256_or_pd(a, b);
+  }
+  static TC_FORCE_INLINE Register select(Register mask,
+                                         Register a,
+                                         Register b) {
+    return _mm256_blendv_pd(b, a, mask);
+  }
+  static TC_FORCE_INLINE int mask_bits(Register mask) {
+    return _mm256_movemask_pd(mask);
+  }
+  static TC_FORCE_INLINE Register load(const float64 *p) {
+    return _mm256_loadu_pd(p);
+  }
+  static TC_FORCE_INLINE void store(float64 *p, Register a) {
+    _mm256_storeu_pd(p, a);
+  }
+};
+#endif
+
+#if defined(__AVX512F__)
+// AVX-512 compares produce a k-register; masks are kept as vectors with the
+// true lanes all ones, like the AVX ones, and turned back with a test.
+template <>
+struct PacketOps<float64, 8> {
+  using Register = __m512d;
+  static TC_FORCE_INLINE Register set1(float64 a) {
+    return _mm512_set1_pd(a);
+  }
+  static TC_FORCE_INLINE Register add(Register a, Register b) {
+    return simd_add(a, b);
+  }
+  static TC_FORCE_INLINE Register sub(Register a, Register b) {
+    return simd_sub(a, b);
+  }
+  static TC_FORCE_INLINE Register mul(Register a, Register b) {
+    return simd_mul(a, b);
+  }
+  static TC_FORCE_INLINE Register div(Register a, Register b) {
+    return simd_div(a, b);
+  }
+  static TC_FORCE_INLINE Register fmadd(Register a, Register b, Register c) {
+    return simd_fmadd(a, b, c);
+  }
+  static TC_FORCE_INLINE Register sqrt(Register a) {
+    return _mm512_sqrt_pd(a);
+  }
+  static TC_FORCE_INLINE Register floor(Register a) {
+    return _mm512_roundscale_pd(a, _MM_FROUND_TO_NEG_INF);
+  }
+  static TC_FORCE_INLINE Register min(Register a, Register b) {
+    return _mm512_min_pd(a, b);
+  }
+  static TC_FORCE_INLINE Register max(Register a, Register b) {
+    return _mm512_max_pd(a, b);
+  }
+  static TC_FORCE_INLINE Register abs(Register a) {
+    return _mm512_abs_pd(a);
+  }
+  static TC_FORCE_INLINE Register neg(Register a) {
+    return _mm512_castsi512_pd(_mm512_xor_si512(
+        _mm512_castpd_si512(a), _mm512_set1_epi64(0x8000000000000000ll)));
+  }
+  static TC_FORCE_INLINE Register less(Register a, Register b) {
+    return from_mask(_mm512_cmp_pd_mask(a, b, _CMP_LT_OQ));
+  }
+  static TC_FORCE_INLINE Register mask_or(Register a, Register b) {
+    return _mm512_castsi512_pd(
+        _mm512_or_si512(_mm512_castpd_si512(a), _mm512_castpd_si512(b)));
+  }
+  static TC_FORCE_INLINE Register select(Register mask,
+                                         Register a,
+                                         Register b) {
+    return _mm512_mask_blend_pd(to_mask(mask), b, a);
+  }
+  static TC_FORCE_INLINE int mask_bits(Register mask) {
+    return to_mask(mask);
+  }
+  static TC_FORCE_INLINE Register load(const float64 *p) {
+    return _mm512_loadu_pd(p);
+  }
+  static TC_FORCE_INLINE void store(float64 *p, Register a) {
+    _mm512_storeu_pd(p, a);
+  }
+
+ private:
+  static TC_FORCE_INLINE Register from_mask(__mmask8 k) {
+    return _mm512_castsi512_pd(_mm512_maskz_set1_epi64(k, -1));
+  }
+  static TC_FORCE_INLINE __mmask8 to_mask(Register mask) {
+    __m512i m = _mm512_castpd_si512(mask);
+    return _mm512_test_epi64_mask(m, m);
+  }
+};
+#endif
+
+template <typename T, int N>
+struct Packet {
+  using Ops = PacketOps<T, N>;
+  using Register = typename Ops::Register;
+  using ScalarType = T;
+  static constexpr int lanes = N;
+  // No union with a T[N]: copies of one would go through memory
+  Register v;
+
+  Packet() = default;
+
+  TC_FORCE_INLINE Packet(T a) : v(Ops::set1(a)) {
+  }
+
+  TC_FORCE_INLINE explicit Packet(Register v) : v(v) {
+  }
+
+  // N consecutive scalars, no alignment required
+  static TC_FORCE_INLINE Packet load(const T *p) {
+    return Packet(Ops::load(p));
+  }
+
+  TC_FORCE_INLINE void store(T *p) const {
+    Ops::store(p, v);
+  }
+
+  TC_FORCE_INLINE T &operator[](int i) {
+    return reinterpret_cast<T *>(&v)[i];
+  }
+
+  TC_FORCE_INLINE const T &operator[](int i) const {
+    return reinterpret_cast<const T *>(&v)[i];
+  }
+
+  TC_FORCE_INLINE friend Packet operator+(Packet a, Packet b) {
+    return Packet(Ops::add(a.v, b.v));
+  }
+
+  TC_FORCE_INLINE friend Packet operator-(Packet a, Packet b) {
+    return Packet(Ops::sub(a.v, b.v));
+  }
+
+  TC_FORCE_INLINE friend Packet operator*(Packet a, Packet b) {
+    return Packet(Ops::mul(a.v, b.v));
+  }
+
+  TC_FORCE_INLINE friend Packet operator/(Packet a, Packet b) {
+    return Packet(Ops::div(a.v, b.v));
+  }
+
+  TC_FORCE_INLINE Packet operator-() const {
+    return Packet(Ops::neg(v));
+  }
+
+  TC_FORCE_INLINE Packet &operator+=(Packet o) {
+    return *this = *this + o;
+  }
+
+  TC_FORCE_INLINE Packet &operator-=(Packet o) {
+    return *this = *this - o;
+  }
+
+  TC_FORCE_INLINE Packet &operator*=(Packet o) {
+    return *this = *this * o;
+  }
+
+  TC_FORCE_INLINE Packet &operator/=(Packet o) {
+    return *this = *this / o;
+  }
+
+  // Lane masks
+  TC_FORCE_INLINE friend Packet operator<(Packet a, Packet b) {
+    return Packet(Ops::less(a.v, b.v));
+  }
+
+  TC_FORCE_INLINE friend Packet operator>(Packet a, Packet b) {
+    return b < a;
+  }
+
+  TC_FORCE_INLINE friend Packet mask_or(Packet a, Packet b) {
+    return Packet(Ops::mask_or(a.v, b.v));
+  }
+
+  // Lane i of the result is a where mask, b elsewhere
+  TC_FORCE_INLINE friend Packet select(Packet mask, Packet a, Packet b) {
+    return Packet(Ops::select(mask.v, a.v, b.v));
+  }
+
+  // Bit i set iff lane i of the mask is
+  TC_FORCE_INLINE friend int mask_bits(Packet mask) {
+    return Ops::mask_bits(mask.v);
+  }
+
+  TC_FORCE_INLINE friend Packet fused_mul_add(Packet a, Packet b, Packet c) {
+    return Packet(Ops::fmadd(a.v, b.v, c.v));
+  }
+
+  TC_FORCE_INLINE friend Packet sqrt(Packet a) {
+    return Packet(Ops::sqrt(a.v));
+  }
+
+  TC_FORCE_INLINE friend Packet floor(Packet a) {
+    return Packet(Ops::floor(a.v));
+  }
+
+  TC_FORCE_INLINE friend Packet abs(Packet a) {
+    return Packet(Ops::abs(a.v));
+  }
+
+  TC_FORCE_INLINE friend Packet min(Packet a, Packet b) {
+    return Packet(Ops::min(a.v, b.v));
+  }
+
+  TC_FORCE_INLINE friend Packet max(Packet a, Packet b) {
+    return Packet(Ops::max(a.v, b.v));
+  }
+
+  TC_FORCE_INLINE friend Packet clamp(Packet a, Packet lo, Packet hi) {
+    return min(max(a, lo), hi);
+  }
+};
+
+template <int dim, typename T, int N>
+using VectorPacket = VectorND<dim, Packet<T, N>>;
+
+template <int dim, typename T, int N>
+using MatrixPacket = MatrixND<dim, Packet<T, N>>;
+
+// Lane scalars broadcast over a whole vector or matrix of packets
+template <int dim, typename T, int N, InstSetExt ISE>
+TC_FORCE_INLINE VectorND<dim, Packet<T, N>, ISE> operator*(
+    T a,
+    const VectorND<dim, Packet<T, N>, ISE> &v) {
+  return Packet<T, N>(a) * v;
+}
+
+template <int dim, typename T, int N, InstSetExt ISE>
+TC_FORCE_INLINE VectorND<dim, Packet<T, N>, ISE> operator*(
+    const VectorND<dim, Packet<T, N>, ISE> &v,
+    T a) {
+  return Packet<T, N>(a) * v;
+}
+
+template <int dim, typename T, int N, InstSetExt ISE>
+TC_FORCE_INLINE MatrixND<dim, Packet<T, N>, ISE> operator*(
+    T a,
+    const MatrixND<dim, Packet<T, N>, ISE> &M) {
+  return Packet<T, N>(a) * M;
+}
+
+template <int dim, typename T, int N, InstSetExt ISE>
+TC_FORCE_INLINE MatrixND<dim, Packet<T, N>, ISE> operator*(
+    const MatrixND<dim, Packet<T, N>, ISE> &M,
+    T a) {
+  return Packet<T, N>(a) * M;
+}
+
+// determinant() needs no overload: the generic one only multiplies and
+// subtracts. polar_decomp() and svd() below are the 2x2 versions above, with
+// the branches of svd() turned into selects.
+template <typename T, int N, InstSetExt ISE>
+TC_FORCE_INLINE void polar_decomp(MatrixND<2, Packet<T, N>, ISE> m,
+                                  MatrixND<2, Packet<T, N>, ISE> &R,
+                                  MatrixND<2, Packet<T, N>, ISE> &S) {
+  using P = Packet<T, N>;
+  P x = m(0, 0) + m(1, 1);
+  P y = m(1, 0) - m(0, 1);
+  P scale = P(T(1)) / sqrt(x * x + y * y);
+  P c = x * scale, s = y * scale;
+  R(0, 0) = c;
+  R(0, 1) = -s;
+  R(1, 0) = s;
+  R(1, 1) = c;
+  S = transposed(R) * m;
+}
+
+template <typename T, int N, InstSetExt ISE>
+inline void svd(MatrixND<2, Packet<T, N>, ISE> m,
+                MatrixND<2, Packet<T, N>, ISE> &U,
+                MatrixND<2, Packet<T, N>, ISE> &sig,
+                MatrixND<2, Packet<T, N>, ISE> &V) {
+  using P = Packet<T, N>;
+  MatrixND<2, P, ISE> S;
+  polar_decomp(m, U, S);
+  P diagonal = abs(S(0, 1)) < P(T(1e-6));
+  P tao = T(0.5) * (S(0, 0) - S(1, 1));
+  P w = sqrt(tao * tao + S(0, 1) * S(0, 1));
+  P t = S(0, 1) / select(P(T(0)) < tao, tao + w, tao - w);
+  P c = P(T(1)) / sqrt(t * t + P(T(1)));
+  P s = -t * c;
+  c = select(diagonal, P(T(1)), c);
+  s = select(diagonal, P(T(0)), s);
+  sig(0, 0) = select(diagonal, S(0, 0),
+                     c * c * S(0, 0) - T(2) * c * s * S(0, 1) + s * s * S(1, 1));
+  sig(1, 1) = select(diagonal, S(1, 1),
+                     s * s * S(0, 0) + T(2) * c * s * S(0, 1) + c * c * S(1, 1));
+  sig(0, 1) = select(diagonal, S(0, 1), P(T(0)));
+  sig(1, 0) = select(diagonal, S(1, 0), P(T(0)));
+  P swap = sig(0, 0) < sig(1, 1);
+  P hi = select(swap, sig(1, 1), sig(0, 0));
+  P lo = select(swap, sig(0, 0), sig(1, 1));
+  sig(0, 0) = hi;
+  sig(1, 1) = lo;
+  V(0, 0) = select(swap, -s, c);
+  V(0, 1) = select(swap, -c, -s);
+  V(1, 0) = select(swap, c, s);
+  V(1, 1) = select(swap, -s, c);
+  V = transposed(V);
+  U = U * V;
+}
+
 template <int dim, typename T>
 inline void test_simple_decompositions() {
   using Matrix = MatrixND<dim, T>;
@@ -11344,7 +12391,10 @@ TC_NAMESPACE_END
 
 
 #include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 #if defined(TC_PLATFORM_WINDOWS)
@@ -11395,10 +12445,211 @@ class Spinlock {
   }
 };
 
+// Persistent work-stealing thread pool. Workers are created once; each call
+// splits [begin, end) evenly over the participating threads, every thread
+// pops grain-sized chunks from the front of its own range and, once that is
+// empty, steals the back half of another thread's range. The calling thread
+// participates as worker 0. Calls made from inside a task (nested
+// parallelism) or while another thread owns the pool run serially inline.
+class ThreadPool {
+ public:
+  // body(worker_id, chunk_begin, chunk_end)
+  using Body = std::function<void(int, int, int)>;
+
+  // Sized once from TC_NUM_THREADS, or the hardware concurrency if unset.
+  static ThreadPool &get_instance() {
+    static ThreadPool pool([] {
+      const char *env = std::getenv("TC_NUM_THREADS");
+      int n = env ? std::atoi(env) : (int)std::thread::hardware_concurrency();
+      return std::max(1, n);
+    }());
+    return pool;
+  }
+
+  int get_num_threads() const {
+    return num_threads;
+  }
+
+  static bool in_task() {
+    return inside_task();
+  }
+
+  void run(int begin, int end, int grain, int max_threads, const Body &body) {
+    if (begin >= end)
+      return;
+    int threads = std::min(num_threads, std::max(1, max_threads));
+    if (grain <= 0)
+      grain = std::max(1, (end - begin) / (threads * 8));
+    std::unique_lock<std::mutex> owner(run_mutex, std::try_to_lock);
+    if (threads == 1 || end - begin <= grain || inside_task() ||
+        !owner.owns_lock()) {
+      bool nested = inside_task();
+      inside_task() = true;
+      body(0, begin, end);
+      inside_task() = nested;
+      return;
+    }
+    int64 n = end - begin;
+    for (int i = 0; i < num_threads; i++) {
+      std::lock_guard<Spinlock> _(ranges[i].lock);
+      ranges[i].begin = i < threads ? begin + int(n * i / threads) : end;
+      ranges[i].end = i < threads ? begin + int(n * (i + 1) / threads) : end;
+    }
+    {
+      std::lock_guard<std::mutex> _(mutex);
+      task = &body;
+      task_grain = grain;
+      task_threads = threads;
+      pending = num_threads - 1;
+      epoch++;
+    }
+    cv_start.notify_all();
+    work(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    cv_done.wait(lock, [this] { return pending == 0; });
+    task = nullptr;
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> _(mutex);
+      exiting = true;
+    }
+    cv_start.notify_all();
+    for (auto &t : workers)
+      t.join();
+  }
+
+ private:
+  struct TC_ALIGNED(64) Range {
+    Spinlock lock;
+    int begin = 0, end = 0;
+  };
+
+  int num_threads;
+  std::unique_ptr<Range[]> ranges;
+  std::vector<std::thread> workers;
+  std::mutex run_mutex, mutex;
+  std::condition_variable cv_start, cv_done;
+  const Body *task = nullptr;
+  int task_grain = 1, task_threads = 1, pending = 0;
+  uint64 epoch = 0;
+  bool exiting = false;
+
+  explicit ThreadPool(int num_threads)
+      : num_threads(num_threads), ranges(new Range[num_threads]) {
+    for (int i = 1; i < num_threads; i++)
+      workers.emplace_back([this, i] { worker_loop(i); });
+  }
+
+  static bool &inside_task() {
+    static thread_local bool flag = false;
+    return flag;
+  }
+
+  bool pop(int id, int &b, int &e) {
+    std::lock_guard<Spinlock> _(ranges[id].lock);
+    if (ranges[id].begin >= ranges[id].end)
+      return false;
+    b = ranges[id].begin;
+    e = std::min(ranges[id].end, b + task_grain);
+    ranges[id].begin = e;
+    return true;
+  }
+
+  bool steal(int id) {
+    for (int k = 1; k < task_threads; k++) {
+      int victim = (id + k) % task_threads, b, e;
+      {
+        std::lock_guard<Spinlock> _(ranges[victim].lock);
+        auto &r = ranges[victim];
+        if (r.end - r.begin <= task_grain)
+          continue;
+        b = r.begin + (r.end - r.begin) / 2;
+        e = r.end;
+        r.end = b;
+      }
+      std::lock_guard<Spinlock> _(ranges[id].lock);
+      ranges[id].begin = b;
+      ranges[id].end = e;
+      return true;
+    }
+    return false;
+  }
+
+  void work(int id) {
+    if (id >= task_threads)
+      return;
+    inside_task() = true;
+    int b, e;
+    do {
+      while (pop(id, b, e))
+        (*task)(id, b, e);
+    } while (steal(id));
+    inside_task() = false;
+  }
+
+  void worker_loop(int id) {
+    uint64 seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_start.wait(lock, [&] { return exiting || epoch != seen; });
+        if (exiting)
+          return;
+        seen = epoch;
+      }
+      work(id);
+      std::lock_guard<std::mutex> _(mutex);
+      if (--pending == 0)
+        cv_done.notify_one();
+    }
+  }
+};
+
+// grain <= 0 picks ~8 chunks per thread.
+template <typename F>
+inline void parallel_for(int begin, int end, const F &f, int grain = 0) {
+  ThreadPool::get_instance().run(
+      begin, end, grain, ThreadPool::get_instance().get_num_threads(),
+      [&f](int, int b, int e) {
+        for (int i = b; i < e; i++)
+          f(i);
+      });
+}
+
+// Each worker folds its chunks into a private partial, partials are then
+// combined in worker order. Chunk-to-worker assignment depends on stealing,
+// so non-associative (floating point) reductions may differ in the last bits.
+template <typename T, typename F, typename R>
+inline T parallel_reduce(int begin,
+                         int end,
+                         const T &identity,
+                         const F &f,
+                         const R &reduce,
+                         int grain = 0) {
+  auto &pool = ThreadPool::get_instance();
+  std::vector<T> partial(pool.get_num_threads(), identity);
+  pool.run(begin, end, grain, pool.get_num_threads(),
+           [&](int id, int b, int e) {
+             for (int i = b; i < e; i++)
+               partial[id] = reduce(partial[id], f(i));
+           });
+  T ret = identity;
+  for (auto &p : partial)
+    ret = reduce(ret, p);
+  return ret;
+}
+
 class ThreadedTaskManager {
  public:
   template <typename T>
   void static run(const T &target, int begin, int end, int num_threads) {
+    ThreadPool::get_instance().run(begin, end, 0, num_threads,
+                                   [&target](int, int b, int e) {
+                                     for (int i = b; i < e; i++)
+                                       target(i);
+                                   });
   }
 
   template <typename T>
@@ -16564,6 +17815,10 @@ TC_NAMESPACE_END
 
 #include <numeric>
 
+// TC_HEADLESS: no window system backend (nothing to link against X11, Gdi32
+// or Cocoa). Canvas still rasterizes into memory, but there is no GUI class.
+#if !defined(TC_HEADLESS)
+
 #if defined(TC_PLATFORM_LINUX)
 #define TC_GUI_X11
 #endif
@@ -16577,6 +17832,8 @@ TC_NAMESPACE_END
 #include <objc/objc.h>
 #endif
 
+#endif
+
 TC_NAMESPACE_BEGIN
 class Canvas {
   struct Context {
@@ -16956,6 +18213,8 @@ class GUIBaseCocoa {
 using GUIBase = GUIBaseCocoa;
 #endif
 
+#if !defined(TC_HEADLESS)
+
 class GUI : public GUIBase {
  public:
   std::string window_name;
@@ -17052,6 +18311,8 @@ class GUI : public GUIBase {
   ~GUI();
 };
 
+#endif
+
 TC_NAMESPACE_END
 
 #if defined(TC_GUI_X11)
@@ -17144,7 +18405,7 @@ GUI::~GUI() {
 TC_NAMESPACE_END
 #endif
 
-#if defined(TC_PLATFORM_WINDOWS)
+#if defined(TC_GUI_WIN32)
 
 #include <map>
 
@@ -5,11 +5,36 @@ add_requires("eigen")
 add_rules("mode.debug", "mode.release")
 set_languages("cxx14")
 
+option("avx2")
+    set_default(true)
+    set_showmenu(true)
+    set_description("Build the 8-wide AVX2/FMA particle kernels")
+option_end()
+
+option("ise")
+    set_default("none")
+    set_showmenu(true)
+    set_values("none", "avx2", "avx512")
+    set_description("Instruction set taichi.h vectors are built for (Vector3d/4d and 8-wide in SIMD registers)")
+option_end()
+
+option("headless")
+    set_default(false)
+    set_showmenu(true)
+    set_description("Batch mode without a window: fixed frames, state dumped to disk")
+    add_defines("TC_HEADLESS")
+option_end()
+
 target("lsmps")
     set_kind("binary")
     add_files("lsmps.cpp")
     add_packages("eigen", {public=true})
-    if is_os("windows") then
+    add_options("headless")
+    if has_config("headless") then
+        if is_os("linux") then
+            add_links("pthread")
+        end
+    elseif is_os("windows") then
         add_links("Gdi32", "User32")
     elseif is_os("linux") then
         add_links("X11", "pthread")
@@ -18,7 +43,22 @@ target("lsmps")
 target("mlsmpm")
     set_kind("binary")
     add_files("mls-mpm88.cpp")
-    if is_os("windows") then
+    if has_config("avx2") then
+        add_vectorexts("avx2", "fma")
+    end
+    if is_config("ise", "avx2") then
+        add_defines("TC_ISE_AVX2")
+        add_vectorexts("avx2", "fma")
+    elseif is_config("ise", "avx512") then
+        add_defines("TC_ISE_AVX512")
+        add_vectorexts("avx2", "fma", "avx512")
+    end
+    add_options("headless")
+    if has_config("headless") then
+        if is_os("linux") then
+            add_links("pthread")
+        end
+    elseif is_os("windows") then
         add_links("Gdi32", "User32")
     elseif is_os("linux") then
         add_links("X11", "pthread")
@@ -28,7 +68,12 @@ target("mps")
     set_kind("binary")
     add_files("mps.cpp")
     add_packages("eigen", {public=true})
-    if is_os("windows") then
+    add_options("headless")
+    if has_config("headless") then
+        if is_os("linux") then
+            add_links("pthread")
+        end
+    elseif is_os("windows") then
         add_links("Gdi32", "User32")
     elseif is_os("linux") then
         add_links("X11", "pthread")